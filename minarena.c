@@ -0,0 +1,92 @@
+/*This file contains a small bump allocator. Things that all go away at the
+ *same time (a directory listing and everything in it, the scratch memory of
+ *one path lookup) are carved out of big blocks one after the other, and
+ *then the whole lot is freed (or reset for reuse) in one call.
+ */
+
+#include "minfs.h"
+
+/*Starts an empty arena that grabs memory blockSize bytes at a time*/
+arena makeArena(long blockSize)
+{
+  arena mem;
+
+  mem = malloc(sizeof(struct mem_arena));
+  mem->blocks = NULL;
+  mem->blockSize = blockSize;
+  mem->bytes = 0;
+
+  return mem;
+}
+
+/*Returns len bytes from the arena. Anything bigger than a block gets a
+ *block all to itself.*/
+void *arenaAlloc(arena mem, long len)
+{
+  arenaBlock block;
+  long size;
+
+  /*Round up so the next thing handed out stays aligned*/
+  len = (len + ARENA_ALIGN - 1) & ~(long)(ARENA_ALIGN - 1);
+
+  block = mem->blocks;
+
+  /*Not enough room left in the current block, start a new one*/
+  if(!block || block->used + len > block->size)
+  {
+    size = len > mem->blockSize ? len : mem->blockSize;
+
+    if( !(block = malloc(sizeof(struct arena_block) + size)) )
+    {
+      perror("arenaAlloc - malloc");
+      exit(EXIT_FAILURE);
+    }
+
+    block->size = size;
+    block->used = 0;
+    block->next = mem->blocks;
+    mem->blocks = block;
+    mem->bytes += size;
+  }
+
+  block->used += len;
+  return block->data + block->used - len;
+}
+
+/*Throws away everything in the arena but keeps one block around, so using
+ *it again doesn't have to go back to malloc*/
+void resetArena(arena mem)
+{
+  arenaBlock block, next;
+
+  if(!mem->blocks)
+    return;
+
+  /*The oldest block is the last one in the list*/
+  for(block = mem->blocks; block->next; block = next)
+  {
+    next = block->next;
+    mem->bytes -= block->size;
+    free(block);
+  }
+
+  block->used = 0;
+  mem->blocks = block;
+}
+
+/*Frees the arena and everything that came out of it*/
+void freeArena(arena mem)
+{
+  arenaBlock block, next;
+
+  if(!mem)
+    return;
+
+  for(block = mem->blocks; block; block = next)
+  {
+    next = block->next;
+    free(block);
+  }
+
+  free(mem);
+}
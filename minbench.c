@@ -0,0 +1,428 @@
+/*minbench times the paths minls and minget spend their time in, on a given
+ *image, and prints one line of JSON per benchmark so runs can be compared.
+ *usage:
+
+ minbench [-n iterations] [-a map|pread] [-p part [-s subpart]] imagefile
+
+ *Benchmarks (each one op per sample):
+ *    findPart     finding the partition (only with -p)
+ *    getSuper     opening the file system (and closing it again)
+ *    resolve      looking up a file's path with an empty dentry cache
+ *    resolveWarm  the same with the dentry cache left alone
+ *    list         reading every entry of a directory
+ *    readFile     copying a file to /dev/null
+ *Up to BENCH_PATHS files and directories are picked by walking the image.
+ */
+
+#include "minfs.h"
+#include <time.h>
+
+/*Most files (and most directories) used for the per-path benchmarks*/
+#define BENCH_PATHS 1024
+
+/*A file or directory found in the image*/
+typedef struct bench_path
+{
+  char *text;   /*The path, for building children's paths*/
+  char **parts; /*The path split up, for resolvePath*/
+  int depth;    /*Number of parts*/
+  uint32_t iNum; /*Inode number*/
+} *benchPath;
+
+/*Timings and counts of one benchmark*/
+typedef struct bench_result
+{
+  char *name;
+  long ops;          /*Samples taken*/
+  double *samples;   /*Time of each op (ns)*/
+  double total;      /*Sum of samples (ns)*/
+  long bytes;        /*Bytes of data the ops moved*/
+  long items;        /*Entries listed, for list*/
+  long reads;        /*imgRead calls made*/
+  long preads;       /*pread calls made*/
+  long bytesRead;    /*Bytes asked of the image*/
+} *benchResult;
+
+void usage()
+{
+  fprintf(stderr, "usage: minbench [-n iterations] [-a map|pread]"
+	  " [-p num [-s num]] imagefile\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "-n  iters   --- times to repeat each benchmark"
+	  " (default: 5)\n");
+  fprintf(stderr, "-a  access  --- map the image or pread it"
+	  " (default: map)\n");
+  fprintf(stderr, "-p  part    --- select partition for filesystem"
+	  " (default: none)\n");
+  fprintf(stderr, "-s  sub     --- select subpartition"
+	  " for filesystem (default: none)\n");
+  exit(EXIT_FAILURE);
+}
+
+/*Monotonic time in ns*/
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*Starts a result that can hold up to maxOps samples*/
+static benchResult startResult(char *name, long maxOps)
+{
+  benchResult result;
+
+  result = calloc(1, sizeof(struct bench_result));
+  result->name = name;
+  result->samples = malloc(sizeof(double) * (maxOps > 0 ? maxOps : 1));
+
+  return result;
+}
+
+/*Records one op that took from start to end*/
+static void addSample(benchResult result, double start, double end)
+{
+  result->samples[result->ops++] = end - start;
+  result->total += end - start;
+}
+
+/*Takes the image counters as of the start of a benchmark away from the
+ *counters as of the end*/
+static void addCounts(benchResult result, imgMap map, long reads,
+		      long preads, long bytes)
+{
+  result->reads += map->reads - reads;
+  result->preads += map->preads - preads;
+  result->bytesRead += map->bytes - bytes;
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+  double x, y;
+
+  x = *(const double *)a;
+  y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/*The given percentile of the samples, in us*/
+static double percentile(benchResult result, double pct)
+{
+  long i;
+
+  i = (long)(pct / 100 * (result->ops - 1) + 0.5);
+  return result->samples[i] / 1e3;
+}
+
+/*Prints a string as a JSON string*/
+static void printString(char *string)
+{
+  putchar('"');
+  for(; *string; string++)
+  {
+    if(*string == '"' || *string == '\\')
+      putchar('\\');
+    putchar(*string);
+  }
+  putchar('"');
+}
+
+/*Prints a result as one line of JSON and frees it*/
+static void printResult(benchResult result, char *image, char *access)
+{
+  double seconds;
+
+  if(result->ops > 0)
+  {
+    qsort(result->samples, result->ops, sizeof(double), compareSamples);
+    seconds = result->total / 1e9;
+
+    printf("{\"bench\":");
+    printString(result->name);
+    printf(",\"image\":");
+    printString(image);
+    printf(",\"access\":\"%s\",\"ops\":%ld,\"seconds\":%.6f", access,
+	   result->ops, seconds);
+    printf(",\"ops_per_sec\":%.1f", seconds > 0 ? result->ops / seconds : 0);
+    printf(",\"bytes_per_sec\":%.1f",
+	   seconds > 0 ? result->bytes / seconds : 0);
+    printf(",\"items_per_sec\":%.1f",
+	   seconds > 0 ? result->items / seconds : 0);
+    printf(",\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f",
+	   percentile(result, 50), percentile(result, 90),
+	   percentile(result, 99), result->samples[result->ops - 1] / 1e3);
+    printf(",\"img_reads\":%ld,\"preads\":%ld,\"bytes_read\":%ld}\n",
+	   result->reads, result->preads, result->bytesRead);
+  }
+
+  free(result->samples);
+  free(result);
+}
+
+/*Makes a path for a child of the given directory (NULL for the root)*/
+static benchPath makePath(benchPath parent, char *name, uint32_t iNum)
+{
+  benchPath path;
+  int i;
+
+  path = malloc(sizeof(struct bench_path));
+  path->iNum = iNum;
+  path->depth = parent ? parent->depth + 1 : 0;
+  path->parts = malloc(sizeof(char *) * (path->depth + 1));
+
+  if(!parent)
+  {
+    path->text = malloc(1);
+    path->text[0] = '\0';
+    return path;
+  }
+
+  path->text = malloc(strlen(parent->text) + strlen(name) + 2);
+  sprintf(path->text, "%s/%s", parent->text, name);
+
+  /*Every part is the tail end of some text, but they need to be separate
+   *strings for resolvePath*/
+  for(i = 0; i < parent->depth; i++)
+    path->parts[i] = parent->parts[i];
+  path->parts[i] = malloc(strlen(name) + 1);
+  strcpy(path->parts[i], name);
+
+  return path;
+}
+
+/*Walks the image breadth first, picking up to BENCH_PATHS directories and
+ *BENCH_PATHS regular files*/
+static void findPaths(tools target, benchPath *dirs, int *numDirs,
+		      benchPath *files, int *numFiles)
+{
+  struct inode folder;
+  dirList list;
+  arena mem;
+  int next, i;
+  char *name;
+
+  dirs[0] = makePath(NULL, NULL, 1);
+  *numDirs = 1;
+  *numFiles = 0;
+
+  for(next = 0; next < *numDirs; next++)
+  {
+    getInode(target, dirs[next]->iNum, &folder);
+    mem = makeArena(ARENA_BLOCK);
+    list = readListing(target, &folder, mem);
+
+    for(i = 0; i < list->count; i++)
+    {
+      name = LISTNAME(list, i);
+      if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+	continue;
+
+      if(ISDIR(list->modes[i]) && *numDirs < BENCH_PATHS)
+	dirs[(*numDirs)++] = makePath(dirs[next], name, list->inodes[i]);
+      else if(ISREG(list->modes[i]) && *numFiles < BENCH_PATHS)
+	files[(*numFiles)++] = makePath(dirs[next], name, list->inodes[i]);
+    }
+
+    freeArena(mem);
+  }
+}
+
+/*Frees what findPaths found. The name each path adds is the last part, the
+ *parts before it belong to its parent.*/
+static void freePaths(benchPath *paths, int count)
+{
+  int i;
+
+  for(i = 0; i < count; i++)
+  {
+    if(paths[i]->depth > 0)
+      free(paths[i]->parts[paths[i]->depth - 1]);
+    free(paths[i]->parts);
+    free(paths[i]->text);
+    free(paths[i]);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  int i, j, iters, access, numDirs, numFiles;
+  long partition, subpart, reads, preads, bytes;
+  char *imageFile, *accessName;
+  double start;
+  FILE *image, *sink;
+  tools target;
+  imgMap map;
+  benchPath dirs[BENCH_PATHS], files[BENCH_PATHS];
+  benchResult result;
+  struct inode node;
+  dirList list;
+  arena mem;
+
+  iters = 5;
+  access = ACCESS_MAP;
+  accessName = "map";
+  partition = -1;
+  subpart = -1;
+
+  while((i = getopt(argc, argv, "n:a:p:s:")) != -1)
+    switch(i)
+    {
+      case 'n':
+	      iters = strtol(optarg, NULL, 10);
+	      if(iters <= 0)
+	        usage();
+	      break;
+      case 'a':
+	      if(strcmp(optarg, "map") == 0)
+	        access = ACCESS_MAP;
+	      else if(strcmp(optarg, "pread") == 0)
+	        access = ACCESS_PREAD;
+	      else
+	        usage();
+	      accessName = optarg;
+	      break;
+      case 'p':
+	      partition = strtol(optarg, NULL, 10);
+	      break;
+      case 's':
+	      subpart = strtol(optarg, NULL, 10);
+	      break;
+      default:
+	      usage();
+	      break;
+    }
+
+  if(optind != argc - 1)
+    usage();
+  imageFile = argv[optind];
+
+  if( !(image = fopen(imageFile, "r")) )
+  {
+    perror(imageFile);
+    exit(EXIT_FAILURE);
+  }
+
+  if( !(sink = fopen("/dev/null", "w")) )
+  {
+    perror("/dev/null");
+    exit(EXIT_FAILURE);
+  }
+
+  /*Finding the partition on its own*/
+  if(partition >= 0)
+  {
+    map = openImage(image, access);
+    result = startResult("findPart", iters);
+
+    for(i = 0; i < iters; i++)
+    {
+      start = now();
+      if(findPart(map, partition, subpart) < 0)
+      {
+	fprintf(stderr, "\nNo minix partition there.\n");
+	exit(EXIT_FAILURE);
+      }
+      addSample(result, start, now());
+    }
+
+    addCounts(result, map, 0, 0, 0);
+    printResult(result, imageFile, accessName);
+    closeImage(map);
+  }
+
+  /*Opening the file system, caches and all*/
+  result = startResult("getSuper", iters);
+  for(i = 0; i < iters; i++)
+  {
+    start = now();
+    if( !(target = getSuper(image, partition, subpart, access)) )
+    {
+      fprintf(stderr, "This doesn't look like a minix file system.\n");
+      exit(EXIT_FAILURE);
+    }
+    addSample(result, start, now());
+
+    addCounts(result, target->map, 0, 0, 0);
+    closeTools(target);
+  }
+  printResult(result, imageFile, accessName);
+
+  /*Everything else uses one opened file system*/
+  target = getSuper(image, partition, subpart, access);
+  findPaths(target, dirs, &numDirs, files, &numFiles);
+
+  /*Path lookups, first from scratch then with everything cached*/
+  result = startResult("resolve", (long)iters * numFiles);
+  reads = target->map->reads;
+  preads = target->map->preads;
+  bytes = target->map->bytes;
+  for(i = 0; i < iters; i++)
+    for(j = 0; j < numFiles; j++)
+    {
+      clearDentries(target);
+      start = now();
+      resolvePath(target, files[j]->parts, files[j]->depth);
+      addSample(result, start, now());
+    }
+  addCounts(result, target->map, reads, preads, bytes);
+  printResult(result, imageFile, accessName);
+
+  result = startResult("resolveWarm", (long)iters * numFiles);
+  reads = target->map->reads;
+  preads = target->map->preads;
+  bytes = target->map->bytes;
+  for(i = 0; i < iters; i++)
+    for(j = 0; j < numFiles; j++)
+    {
+      start = now();
+      resolvePath(target, files[j]->parts, files[j]->depth);
+      addSample(result, start, now());
+    }
+  addCounts(result, target->map, reads, preads, bytes);
+  printResult(result, imageFile, accessName);
+
+  /*Full directory listings*/
+  result = startResult("list", (long)iters * numDirs);
+  reads = target->map->reads;
+  preads = target->map->preads;
+  bytes = target->map->bytes;
+  for(i = 0; i < iters; i++)
+    for(j = 0; j < numDirs; j++)
+    {
+      mem = makeArena(ARENA_BLOCK);
+      start = now();
+      getInode(target, dirs[j]->iNum, &node);
+      list = readListing(target, &node, mem);
+      addSample(result, start, now());
+      result->items += list->count;
+      freeArena(mem);
+    }
+  addCounts(result, target->map, reads, preads, bytes);
+  printResult(result, imageFile, accessName);
+
+  /*Whole files*/
+  result = startResult("readFile", (long)iters * numFiles);
+  reads = target->map->reads;
+  preads = target->map->preads;
+  bytes = target->map->bytes;
+  for(i = 0; i < iters; i++)
+    for(j = 0; j < numFiles; j++)
+    {
+      getInode(target, files[j]->iNum, &node);
+      start = now();
+      readFile(target, &node, sink);
+      addSample(result, start, now());
+      result->bytes += node.size;
+    }
+  addCounts(result, target->map, reads, preads, bytes);
+  printResult(result, imageFile, accessName);
+
+  freePaths(dirs, numDirs);
+  freePaths(files, numFiles);
+  closeTools(target);
+  fclose(sink);
+  fclose(image);
+
+  return 0;
+}
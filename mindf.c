@@ -0,0 +1,136 @@
+/*mindf is a unix program that says how full a minix file system image is,
+ *the way df does, by counting the inode and zone bitmaps instead of walking
+ *every directory.
+ *usage:
+
+ mindf [-v] [--stats[=table|json]] [--trace file] [-p part [-s subpart]]
+       imagefile
+
+ *The verbose argument also prints how long counting the bitmaps took
+ *The stats argument prints what was read from the image to stderr
+ *The trace argument writes how long each phase took to a file, in Chrome
+ *    trace-event format
+ */
+
+#include "minfs.h"
+#include <time.h>
+#include <getopt.h>
+
+/*Options that only have a long form*/
+static struct option longOptions[] = {
+  {"stats", optional_argument, NULL, OPT_STATS},
+  {"trace", required_argument, NULL, OPT_TRACE},
+  {NULL, 0, NULL, 0}
+};
+
+void usage()
+{
+  fprintf(stderr, "usage: mindf [-v] [--stats[=table|json]] [--trace file]"
+	  " [-p part [-s subpart]] imagefile\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "-p  part    --- select partition for filesystem"
+	  " (default: none)\n");
+  fprintf(stderr, "-s  sub     --- select subpartition for filesystem"
+	  " (default: none)\n");
+  fprintf(stderr, "-v  verbose --- say how long counting took\n");
+  fprintf(stderr, "--stats[=table|json] --- print I/O statistics to stderr\n");
+  fprintf(stderr, "--trace file --- write a timeline of each phase to file\n");
+  exit(EXIT_FAILURE);
+}
+
+/*Prints one row of the table*/
+static void printRow(char *name, unsigned long total, unsigned long used)
+{
+  printf("%-8s %14lu %14lu %14lu %5.0f%%\n", name, total, used,
+	 total > used ? total - used : 0,
+	 total ? 100.0 * used / total : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+  struct fs_usage counts;
+  struct timespec before, after;
+  unsigned long zonesize, usedZones;
+  long int partition, subpart;
+  int i, verbose, stats;
+  FILE *image;
+  tools target;
+  super sb;
+
+  verbose = 0;
+  partition = -1;
+  subpart = -1;
+  stats = STATS_NONE;
+
+  while((i = getopt_long(argc, argv, "vp:s:", longOptions, NULL)) != -1)
+    switch(i)
+    {
+      case 'v':
+	      verbose = 1;
+	      break;
+      case 'p':
+	      partition = strtol(optarg, NULL, 10);
+	      break;
+      case 's':
+	      subpart = strtol(optarg, NULL, 10);
+	      break;
+      case OPT_STATS:
+	      if( (stats = statsFormat(optarg)) < 0 )
+	        usage();
+	      break;
+      case OPT_TRACE:
+	      if( startTrace(optarg) < 0 )
+	        exit(EXIT_FAILURE);
+	      break;
+      default:
+	      usage();
+	      break;
+    }
+
+  if(optind != argc - 1)
+    usage();
+
+  if( !(image = fopen(argv[optind], "r")) )
+  {
+    perror(argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+
+  if( !(target = getSuper(image, partition, subpart, ACCESS_MAP)) )
+  {
+    fprintf(stderr, "This doesn't look like a minix file system.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &before);
+  getUsage(target, &counts);
+  clock_gettime(CLOCK_MONOTONIC, &after);
+
+  sb = target->superblock;
+  zonesize = target->zonesize;
+
+  /*Everything before the first data zone (boot block, superblock, bitmaps
+   *and inode table) is always in use*/
+  usedZones = counts.zones - counts.dataZones + counts.usedZones;
+
+  printf("%s: block size %u, zone size %lu, %d inode and %d zone bitmap"
+	 " blocks, first data zone %u\n", argv[optind], sb->blocksize,
+	 zonesize, sb->i_blocks, sb->z_blocks, sb->firstdata);
+  printf("%-8s %14s %14s %14s %6s\n", "", "total", "used", "free", "use");
+  printRow("inodes", counts.inodes, counts.usedInodes);
+  printRow("zones", counts.zones, usedZones);
+  printRow("bytes", counts.zones * zonesize, usedZones * zonesize);
+
+  if(verbose)
+    fprintf(stderr, "bitmaps counted in %.3f ms\n",
+	    (after.tv_sec - before.tv_sec) * 1e3 +
+	    (after.tv_nsec - before.tv_nsec) / 1e6);
+
+  if(stats)
+    printStats(target, stats);
+
+  closeTools(target);
+  fclose(image);
+
+  return 0;
+}
@@ -0,0 +1,522 @@
+/*minfind is a unix program that finds the files in a minix file system
+ *image with a given type, size, owner or timestamps. Instead of walking the
+ *directory tree it reads the inode table in order, in big chunks spread
+ *over a pool of threads, and skips whatever the inode bitmap says is free.
+ *Directories found along the way have their entries noted, so only the
+ *matching inodes ever get a path put together for them.
+ *usage:
+
+ minfind [-l] [-j threads] [-b bytes] [-t type] [-S min:max] [-A min:max]
+         [-M min:max] [-C min:max] [-u uid] [-g gid] [--stats[=table|json]]
+         [--trace file] [-p part [-s subpart]] imagefile
+
+ *type is one of f (regular file), d, l, c, b, p or s
+ *The ranges are sizes in bytes and access, modify and change times in
+ *    seconds since the epoch, inclusive, and either end can be left off
+ *The long argument prints mode, links, owner, size and modify time too
+ *Files are printed in inode order. An inode no directory names (or that
+ *    is only named from somewhere not reachable) starts with #inode.
+ */
+
+#include "minfs.h"
+#include <time.h>
+#include <limits.h>
+#include <getopt.h>
+
+/*Options that only have a long form*/
+static struct option longOptions[] = {
+  {"stats", optional_argument, NULL, OPT_STATS},
+  {"trace", required_argument, NULL, OPT_TRACE},
+  {NULL, 0, NULL, 0}
+};
+
+/*What an inode has to look like to be printed*/
+typedef struct find_pred
+{
+  uint16_t type;    /*FILE_TYPE_MASK bits, 0 for anything*/
+  long minSize, maxSize;
+  long minTime[3];  /*atime, mtime, ctime*/
+  long maxTime[3];
+  long uid, gid;    /*-1 for anyone*/
+} *findPred;
+
+/*Everything the workers of a scan share*/
+typedef struct find_job
+{
+  tools target;
+  struct find_pred pred;
+  unsigned char *imap;   /*Inode bitmap*/
+  long imapBits;         /*Bits in it*/
+  uint32_t *parent;      /*Directory each inode was first found in, or 0*/
+  char **names;          /*Name it was found under*/
+  unsigned char *matched; /*1 for every inode that matched*/
+  arena *mems;           /*Each worker's copies of names*/
+  uint32_t perChunk;     /*Inodes in a run of the table*/
+} *findJob;
+
+/*A run of the inode table for one worker to go through, or (count 0) the
+ *task that hands out all the runs*/
+typedef struct scan_task
+{
+  uint32_t first; /*First inode number in it*/
+  uint32_t count;
+} *scanTask;
+
+/*Type letters and the modes they stand for*/
+static char *typeLetters = "fdlcbps";
+static uint16_t typeModes[] = {0100000, 0040000, 0120000, 0020000, 0060000,
+			       0010000, 0140000};
+
+void usage()
+{
+  fprintf(stderr, "usage: minfind [-l] [-j threads] [-b bytes] [-t type]"
+	  " [-S min:max] [-A min:max]\n"
+	  "               [-M min:max] [-C min:max] [-u uid] [-g gid]"
+	  " [--stats[=table|json]]\n"
+	  "               [--trace file] [-p part [-s subpart]]"
+	  " imagefile\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "-t  type    --- f, d, l, c, b, p or s\n");
+  fprintf(stderr, "-S  min:max --- size in bytes\n");
+  fprintf(stderr, "-A  min:max --- access time (seconds since the epoch)\n");
+  fprintf(stderr, "-M  min:max --- modify time\n");
+  fprintf(stderr, "-C  min:max --- change time\n");
+  fprintf(stderr, "-u  uid     --- owned by this user\n");
+  fprintf(stderr, "-g  gid     --- owned by this group\n");
+  fprintf(stderr, "-l  long    --- print mode, links, owner, size and"
+	  " modify time\n");
+  fprintf(stderr, "-j  threads --- number of threads (default: cpus)\n");
+  fprintf(stderr, "-b  bytes   --- inode table read at a time"
+	  " (default: %ld)\n", SCAN_CHUNK);
+  fprintf(stderr, "-p  part    --- select partition for filesystem"
+	  " (default: none)\n");
+  fprintf(stderr, "-s  sub     --- select subpartition for filesystem"
+	  " (default: none)\n");
+  fprintf(stderr, "--stats[=table|json] --- print I/O statistics to stderr\n");
+  fprintf(stderr, "--trace file --- write a timeline of each phase to file\n");
+  exit(EXIT_FAILURE);
+}
+
+/*Reads min:max, where either can be left off. Returns -1 if it isn't.*/
+static int parseRange(char *arg, long *min, long *max)
+{
+  char *end;
+
+  if(*arg != ':')
+  {
+    *min = strtol(arg, &end, 10);
+    if(end == arg)
+      return -1;
+    arg = end;
+  }
+
+  if(*arg == '\0')
+  {
+    *max = *min;
+    return 0;
+  }
+
+  if(*arg++ != ':')
+    return -1;
+
+  if(*arg != '\0')
+  {
+    *max = strtol(arg, &end, 10);
+    if(*end != '\0')
+      return -1;
+  }
+
+  return 0;
+}
+
+/*Checks one inode against everything asked for*/
+static int matches(findPred pred, inode node)
+{
+  long times[3];
+  int i;
+
+  if(pred->type && (node->mode & FILE_TYPE_MASK) != pred->type)
+    return 0;
+  if(node->size < pred->minSize || node->size > pred->maxSize)
+    return 0;
+  if((pred->uid >= 0 && node->uid != pred->uid) ||
+     (pred->gid >= 0 && node->gid != pred->gid))
+    return 0;
+
+  times[0] = node->atime;
+  times[1] = node->mtime;
+  times[2] = node->ctime;
+  for(i = 0; i < 3; i++)
+    if(times[i] < pred->minTime[i] || times[i] > pred->maxTime[i])
+      return 0;
+
+  return 1;
+}
+
+/*Notes which directory each entry of this one was found in, and as what.
+ *Only the entries themselves are read, the inodes they name are checked
+ *when the scan gets to them. With hard links, whichever directory gets
+ *there first wins.*/
+static void noteEntries(findJob job, int worker, uint32_t dirNum,
+			inode folder, arena scratch)
+{
+  uint32_t child, none;
+  dirIter iter;
+  fileEnt file;
+  char *name;
+  long len;
+
+  iter = openDir(job->target, folder, scratch);
+
+  while( (file = nextEnt(iter)) )
+  {
+    child = file->inode;
+    name = (char *)file->name;
+    len = strnlen(name, 60);
+
+    if(child > job->target->superblock->ninodes ||
+       (len == 1 && name[0] == '.') ||
+       (len == 2 && name[0] == '.' && name[1] == '.'))
+      continue;
+
+    /*Only the one that sets the parent writes the name, and nothing reads
+     *either until every worker is done*/
+    none = 0;
+    if(__atomic_compare_exchange_n(&job->parent[child], &none, dirNum, 0,
+				   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+      /*Names may fill all 60 bytes, so they get a nul-byte of their own*/
+      job->names[child] = arenaAlloc(job->mems[worker], len + 1);
+      memcpy(job->names[child], name, len);
+      job->names[child][len] = '\0';
+    }
+  }
+
+  closeDir(iter);
+  resetArena(scratch);
+}
+
+/*Says whether any inode in [first, last) is marked in use. Only that part
+ *of the bitmap is looked at, so checking every run is one pass over it.*/
+static int anyInUse(findJob job, long first, long last)
+{
+  unsigned char *imap;
+  long i;
+
+  imap = job->imap;
+  if(last > job->imapBits)
+    last = job->imapBits;
+
+  /*Bits up to a byte boundary, whole bytes, then whatever is left*/
+  for(i = first; i < last && i % 8; i++)
+    if( (imap[i / 8] >> (i % 8)) & 1 )
+      return 1;
+
+  for(; i + 8 <= last; i += 8)
+    if(imap[i / 8])
+      return 1;
+
+  for(; i < last; i++)
+    if( (imap[i / 8] >> (i % 8)) & 1 )
+      return 1;
+
+  return 0;
+}
+
+/*Hands out the inode table a run at a time. Done from inside the pool, so
+ *it can't run out of work before all of them are in. Runs are whole words
+ *of the bitmap, so whole words can be skipped, and runs the bitmap says
+ *are all free aren't even read.*/
+static void planScan(pool p, int worker, findJob job)
+{
+  uint32_t i, count, ninodes;
+  scanTask run;
+
+  ninodes = job->target->superblock->ninodes;
+
+  /*Inode 0 doesn't exist, so the first run is one short*/
+  for(i = 1; i <= ninodes; i += count)
+  {
+    count = (i / job->perChunk + 1) * job->perChunk - i;
+    if(count > ninodes + 1 - i)
+      count = ninodes + 1 - i;
+
+    if( !anyInUse(job, i, (long)i + count) )
+      continue;
+
+    run = malloc(sizeof(struct scan_task));
+    run->first = i;
+    run->count = count;
+    poolSubmit(p, worker, run);
+  }
+}
+
+/*What each worker does with a run of the inode table: read it in one go,
+ *check every inode the bitmap says is in use, and note the entries of any
+ *directories*/
+static void scanTaskFn(pool p, int worker, void *task, void *arg)
+{
+  struct inode node;
+  unsigned char *table, *scratch;
+  uint32_t i, last;
+  findJob job;
+  scanTask run;
+  arena dirMem;
+  double start;
+
+  job = arg;
+  run = task;
+
+  if(run->count == 0)
+  {
+    planScan(p, worker, job);
+    free(run);
+    return;
+  }
+
+  start = traceStart();
+
+  last = run->first + run->count;
+  scratch = job->target->map->direct ? NULL :
+    malloc((long)run->count * INODE_SIZE);
+  table = imgRead(job->target->map, job->target->inodeOff +
+		  (long)(run->first - 1) * INODE_SIZE,
+		  (long)run->count * INODE_SIZE, scratch, IO_INODE);
+  dirMem = makeArena(ARENA_BLOCK);
+
+  for(i = run->first; i < last; i++)
+  {
+    if(i >= job->imapBits)
+      break;
+
+    /*Skip a whole word of free inodes at once*/
+    if(i % 64 == 0 && i + 64 <= job->imapBits &&
+       ((uint64_t *)job->imap)[i / 64] == 0)
+    {
+      i += 63;
+      continue;
+    }
+
+    if( !((job->imap[i / 8] >> (i % 8)) & 1) )
+      continue;
+
+    memcpy(&node, table + (long)(i - run->first) * INODE_SIZE,
+	   sizeof(struct inode));
+    if(node.mode == 0)
+      continue;
+
+    if(matches(&job->pred, &node))
+      job->matched[i] = 1;
+
+    if(ISDIR(node.mode))
+      noteEntries(job, worker, i, &node, dirMem);
+  }
+
+  traceSpan(start, "scan", NULL, "\"first\":%u,\"count\":%u", run->first,
+	    run->count);
+
+  freeArena(dirMem);
+  free(scratch);
+  free(run);
+}
+
+/*Puts together the path of an inode from the names noted during the scan.
+ *Anything that doesn't lead back to the root starts with #inode.*/
+static char *inodePath(findJob job, uint32_t iNum, char *path, long size)
+{
+  uint32_t steps, cur;
+  long len, at;
+
+  if(iNum == 1)
+  {
+    strcpy(path, "/");
+    return path;
+  }
+
+  /*Built from the end backwards*/
+  at = size - 1;
+  path[at] = '\0';
+
+  for(cur = iNum, steps = 0; cur != 1 && job->parent[cur] &&
+	steps <= job->target->superblock->ninodes; steps++)
+  {
+    len = strlen(job->names[cur]);
+    if(at < len + 1 + 12)
+      break;
+    at -= len;
+    memcpy(path + at, job->names[cur], len);
+    path[--at] = '/';
+    cur = job->parent[cur];
+  }
+
+  if(cur != 1)
+  {
+    len = sprintf(path, "#%u", cur);
+    memmove(path + len, path + at, size - at);
+    return path;
+  }
+
+  return path + at;
+}
+
+int main(int argc, char *argv[])
+{
+  struct find_job job;
+  struct inode node;
+  uint32_t i, ninodes;
+  long int partition, subpart, threads, chunk;
+  int opt, longList, stats;
+  char perms[PERM_LEN], when[32], *path, *type;
+  void *mapScratch;
+  scanTask run;
+  FILE *image;
+  tools target;
+  time_t mtime;
+  double start;
+  pool p;
+
+  memset(&job, 0, sizeof(job));
+  job.pred.maxSize = 0xFFFFFFFFL;
+  for(opt = 0; opt < 3; opt++)
+  {
+    job.pred.minTime[opt] = INT32_MIN;
+    job.pred.maxTime[opt] = INT32_MAX;
+  }
+  job.pred.uid = -1;
+  job.pred.gid = -1;
+
+  longList = 0;
+  partition = -1;
+  subpart = -1;
+  threads = defaultWorkers();
+  chunk = SCAN_CHUNK;
+  stats = STATS_NONE;
+
+  while((opt = getopt_long(argc, argv, "lj:b:t:S:A:M:C:u:g:p:s:",
+			   longOptions, NULL)) != -1)
+    switch(opt)
+    {
+      case 'l':
+	      longList = 1;
+	      break;
+      case 'j':
+	      threads = strtol(optarg, NULL, 10);
+	      if(threads <= 0)
+	        usage();
+	      break;
+      case 'b':
+	      chunk = strtol(optarg, NULL, 10);
+	      if(chunk <= 0)
+	        usage();
+	      break;
+      case 't':
+	      if( strlen(optarg) != 1 || !(type = strchr(typeLetters, *optarg)) )
+	        usage();
+	      job.pred.type = typeModes[type - typeLetters];
+	      break;
+      case 'S':
+	      if( parseRange(optarg, &job.pred.minSize, &job.pred.maxSize) < 0 )
+	        usage();
+	      break;
+      case 'A':
+      case 'M':
+      case 'C':
+	      i = opt == 'A' ? 0 : opt == 'M' ? 1 : 2;
+	      if( parseRange(optarg, &job.pred.minTime[i],
+			     &job.pred.maxTime[i]) < 0 )
+	        usage();
+	      break;
+      case 'u':
+	      job.pred.uid = strtol(optarg, NULL, 10);
+	      break;
+      case 'g':
+	      job.pred.gid = strtol(optarg, NULL, 10);
+	      break;
+      case 'p':
+	      partition = strtol(optarg, NULL, 10);
+	      break;
+      case 's':
+	      subpart = strtol(optarg, NULL, 10);
+	      break;
+      case OPT_STATS:
+	      if( (stats = statsFormat(optarg)) < 0 )
+	        usage();
+	      break;
+      case OPT_TRACE:
+	      if( startTrace(optarg) < 0 )
+	        exit(EXIT_FAILURE);
+	      break;
+      default:
+	      usage();
+	      break;
+    }
+
+  if(optind != argc - 1)
+    usage();
+
+  if( !(image = fopen(argv[optind], "r")) )
+  {
+    perror(argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+
+  if( !(target = getSuper(image, partition, subpart, ACCESS_MAP)) )
+  {
+    fprintf(stderr, "This doesn't look like a minix file system.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  ninodes = target->superblock->ninodes;
+  job.target = target;
+  job.imap = readInodeMap(target, &mapScratch, &job.imapBits);
+  job.parent = calloc(ninodes + 1, sizeof(uint32_t));
+  job.names = calloc(ninodes + 1, sizeof(char *));
+  job.matched = calloc(ninodes + 1, sizeof(char));
+  job.mems = malloc(sizeof(arena) * threads);
+  for(opt = 0; opt < threads; opt++)
+    job.mems[opt] = makeArena(ARENA_BLOCK);
+
+  job.perChunk = (chunk / INODE_SIZE + 63) / 64 * 64;
+  start = traceStart();
+  p = makePool(threads, scanTaskFn, &job);
+  run = calloc(1, sizeof(struct scan_task));
+  poolSubmit(p, -1, run);
+  finishPool(p);
+  traceSpan(start, "scanTable", NULL, "\"inodes\":%u", ninodes);
+
+  /*Only now are paths put together, and only for what matched*/
+  path = malloc(PATH_MAX);
+  for(i = 1; i <= ninodes; i++)
+  {
+    if(!job.matched[i])
+      continue;
+
+    if(longList)
+    {
+      getInode(target, i, &node);
+      mtime = node.mtime;
+      strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&mtime));
+      printf("%s %3u %5u %5u %9u %s %s\n", getMode(node.mode, perms),
+	     node.links, node.uid, node.gid, node.size, when,
+	     inodePath(&job, i, path, PATH_MAX));
+    }
+    else
+      printf("%s\n", inodePath(&job, i, path, PATH_MAX));
+  }
+
+  if(stats)
+    printStats(target, stats);
+
+  for(opt = 0; opt < threads; opt++)
+    freeArena(job.mems[opt]);
+  free(job.mems);
+  free(job.matched);
+  free(job.names);
+  free(job.parent);
+  free(mapScratch);
+  free(path);
+  closeTools(target);
+  fclose(image);
+
+  return 0;
+}
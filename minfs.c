@@ -1,6 +1,18 @@
-/*This file contains useful functions for navigating the given FILE * */
+/*This file contains useful functions for navigating the given FILE *
+ *Nothing in here moves a shared file position or keeps per-call state in
+ *the tools, anything that has to be read somewhere goes into a buffer the
+ *caller hands in. That way one opened image can be used from many threads.
+ */
+
+/*For copy_file_range*/
+#define _GNU_SOURCE
 
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include "minfs.h"
 
 /*To stop gcc from yelling at me about how minls doesn't use the below
@@ -10,13 +22,25 @@ static uint8_t PART_SIG_1 = PARTITION_VALID_1;
 static uint8_t PART_SIG_2 = PARTITION_VALID_2;
 static uint8_t MIN_PART_TYPE = PARTITION_TYPE;
 
-/*This function reads the mode and creates the permission string*/
-char *getMode(uint16_t perms)
+/*Frees everything getSuper set up, including the image mapping. The FILE *
+ *is left for the caller to close.*/
+void closeTools(tools target)
 {
-  char *string;
+  if(!target)
+    return;
+
+  freeInodeCache(target->icache);
+  freeIndexes(target->indexes);
+  freeDentries(target);
+  freeArena(target->mem);
+  closeImage(target->map);
+  free(target);
+}
 
-  string = malloc(sizeof(char) * PERM_LEN);
-  
+/*This function reads the mode and writes the permission string into
+ *string, which must hold PERM_LEN bytes*/
+char *getMode(uint16_t perms, char *string)
+{
   /*If its a directory, save a 'd'*/
   string[0] = (ISDIR(perms) ? 'd': '-');
   /*User permissions*/
@@ -42,23 +66,19 @@ char *getMode(uint16_t perms)
  *Note that the valid bytes may not be with respect to the very beginning, 
  *    but instead to the beginning of the partition table.
  */
-int validatePart(FILE *image)
+int validatePart(imgMap map, long offset)
 {
-  uint8_t bytesRead[2];
-  
-  /*Seek to signature bytes*/
-  if( fseek(image, 510, SEEK_CUR) != 0 )
-  {
-    perror("fseek - validate");
-    exit(EXIT_FAILURE);
-  }
+  uint8_t sig[2], *bytesRead;
 
-  /*Read 2 signature bytes into buffer*/
-  if( fread(bytesRead, sizeof(uint8_t), 2, image) != 2 )
+  /*The whole sector has to be there, not just the signature*/
+  if(offset < 0 || offset > map->size - SECTOR_SIZE)
   {
-    perror("fread - validate");
-    exit(EXIT_FAILURE);
+    fprintf(stderr, "Partition table past the end of the image.\n");
+    return -1;
   }
+  
+  /*Look at the 2 signature bytes*/
+  bytesRead = imgRead(map, offset + 510, 2, sig, IO_PART);
 
   /*Starts out in the right order*/
   if(bytesRead[0] == PART_SIG_1)
@@ -104,24 +124,18 @@ int validatePart(FILE *image)
  *partition table and finds the (verified) partition entry. The value 'lFirst'
  *in the partition table entry is returned as the new offset
  */
-long findPartOffset(long offset, FILE *image, int sect)
+long findPartOffset(long offset, imgMap map, int sect)
 {
   long newOffset;
+  struct partition_entry entry;
   partEnt target;
   int err;
 
   /*Set the newOffset as the start of the partition*/
   newOffset = offset;
   
-  /*Seek to partition table*/
-  if( fseek(image, newOffset, SEEK_SET) != 0 )
-  {
-    perror("findPartOffset - fseek");
-    exit(EXIT_FAILURE);
-  }
-
   /*Validate the partition table*/
-  if( (err = validatePart(image)) < 0 )
+  if( (err = validatePart(map, newOffset)) < 0 )
     /*Return the specific error*/
     return err;
 
@@ -131,21 +145,9 @@ long findPartOffset(long offset, FILE *image, int sect)
   newOffset = newOffset + TABLE_START +
     (sect * sizeof(struct partition_entry));
   
-  if( fseek(image, newOffset , SEEK_SET) != 0 )
-  {
-    perror("findPartOffset - fseek");
-    exit(EXIT_FAILURE);
-  }
-
-  /*Allocate memory for the partition entry*/
-  target = malloc(sizeof(struct partition_entry));
-  
-  /*Read entry in partition table into data structure*/
-  if( !fread(target, sizeof(struct partition_entry), 1, image) )
-  {
-    perror("findPartOffset - fread");
-    exit(EXIT_FAILURE);
-  }
+  /*Look at the entry in the partition table*/
+  target = imgRead(map, newOffset, sizeof(struct partition_entry), &entry,
+		   IO_PART);
 
   /*Confirm that the partition table is for minix*/
   if( target->type != MIN_PART_TYPE )
@@ -159,10 +161,7 @@ long findPartOffset(long offset, FILE *image, int sect)
    *save the beginning of the partition as the new offset to read the 
    *file system from.
    */
-  newOffset = (target->lFirst) * SECTOR_SIZE;
-
-  /*The partition entry is no longer needed*/
-  free(target);
+  newOffset = (long)(target->lFirst) * SECTOR_SIZE;
   
   return newOffset;
 }
@@ -171,7 +170,7 @@ long findPartOffset(long offset, FILE *image, int sect)
  *file for the correct partition. It returns the offset of the desired file
  *system, or a negative number when the desired partition is not found.
  */
-long findPart(FILE *image, int part, int subpart)
+long findPart(imgMap map, int part, int subpart)
 {
   long offset;
 
@@ -179,7 +178,7 @@ long findPart(FILE *image, int part, int subpart)
   offset = 0;
 
   /*Find the offset of the desired partition*/
-  if( (offset = findPartOffset(offset, image, part)) < 0 )
+  if( (offset = findPartOffset(offset, map, part)) < 0 )
     /*Return invalid offset*/
     return offset;
 
@@ -188,26 +187,62 @@ long findPart(FILE *image, int part, int subpart)
     /*Find offset of that partition (offsets are relative to beginning of 
      *image). Do note that we just return immediately after this, so thats why
      *I'm not checking the return value.*/
-    offset = findPartOffset(offset, image, subpart);
+    offset = findPartOffset(offset, map, subpart);
     
   /*Read partition table entry*/
   return offset;
 }
 
+/*Checks that the superblock describes something that could be there: a
+ *power of two block size, zones that fit in an int, and bitmaps and an
+ *inode table that all end before the image does. Anything that passes can
+ *have any inode in it looked up without reading past the end.*/
+static int saneSuper(super sb, long offset, long size)
+{
+  long tableEnd;
+
+  if(sb->blocksize < 1024 || (sb->blocksize & (sb->blocksize - 1)) ||
+     sb->log_zone_size < 0 || sb->log_zone_size > 14 ||
+     sb->i_blocks < 1 || sb->z_blocks < 1 || sb->ninodes < 1)
+    return 0;
+
+  tableEnd = offset + (2L + sb->i_blocks + sb->z_blocks) * sb->blocksize +
+    (long)sb->ninodes * INODE_SIZE;
+
+  return tableEnd <= size;
+}
+
 /*This function fills out the superblock, offset, and zonesize portions of
- *the file_tools structure*/
-tools getSuper(FILE *image, int part, int subpart)
+ *the file_tools structure. access says whether the image may be mapped
+ *(ACCESS_MAP) or should always be read with pread (ACCESS_PREAD).*/
+tools getSuper(FILE *image, int part, int subpart, int access)
 {
   tools target;
+  imgMap map;
   long targetOffset, ltemp;
   int temp;
+  double start, partStart;
+
+  start = traceStart();
+
+  /*Get the image into memory first, everything else reads from there*/
+  map = openImage(image, access);
   
   /*First determine the partition/subpartition, if a partition was specified*/
   if(part >= 0)
   {
     /*If the partition was not found, return an empty target. < 0 is invalid*/
-    if( (targetOffset = findPart(image, part, subpart)) < 0 )
+    partStart = traceStart();
+    targetOffset = findPart(map, part, subpart);
+    traceSpan(partStart, "findPart", NULL,
+	      "\"part\":%d,\"subpart\":%d,\"offset\":%ld",
+	      part, subpart, targetOffset);
+
+    if(targetOffset < 0)
+    {
+      closeImage(map);
       return NULL;
+    }
   }
   else
     targetOffset = 0;
@@ -218,25 +253,26 @@ tools getSuper(FILE *image, int part, int subpart)
   /*Mark offset in the tools*/
   target->offset = targetOffset;
 
-  /*Seek to the location of the superblock in filesystem*/
-  if( fseek(image, targetOffset + SUPER_START, SEEK_SET) != 0 )
-  {
-    /*fseek failed*/
-    perror("getTools super - fseek");
-    exit(EXIT_FAILURE);
-  }
+  /*Nothing has been looked up yet*/
+  target->inode = NULL;
+  target->iNum = 0;
+  target->numFiles = 0;
+  target->files = NULL;
 
-  /*Allocate memory for the superblock*/
-  target->superblock = malloc(sizeof(struct superblock));
-  
-  /*Lift the superblock data out of the image and into our data structure*/
-  if( !fread(target->superblock, sizeof(struct superblock), 1, image) )
+  /*Too short to even have a superblock*/
+  if(targetOffset > map->size - SUPER_START - (long)sizeof(struct superblock))
   {
-    /*fread failed*/
-    perror("getTools super - fread");
-    exit(EXIT_FAILURE);
+    fprintf(stderr, "Superblock past the end of the image.\n");
+    closeImage(map);
+    free(target);
+    return NULL;
   }
 
+  /*The superblock is read straight out of the image*/
+  target->superblock = imgRead(map, targetOffset + SUPER_START,
+			       sizeof(struct superblock), &target->superBuf,
+			       IO_SUPER);
+
   /*Validate the superblock by checking the magic number*/
   if( ((target->superblock)->magic) != MAGIC )
   {
@@ -246,16 +282,28 @@ tools getSuper(FILE *image, int part, int subpart)
     {
       fprintf(stderr, "Reversed magic number. (0x%X)\n",
 	      target->superblock->magic);
+      closeImage(map);
+      free(target);
       return NULL;
     }
     /*If it doesn't match any known magic numbers*/
     else
     {
       fprintf(stderr, "Bad magic number. (0x%X)\n", target->superblock->magic);
+      closeImage(map);
+      free(target);
       return NULL;
     }
   }
 
+  if( !saneSuper(target->superblock, targetOffset, map->size) )
+  {
+    fprintf(stderr, "Superblock doesn't fit the image.\n");
+    closeImage(map);
+    free(target);
+    return NULL;
+  }
+
   /*Figure out various values we will need to do everything*/
   
   /*Calculate zone size for reporting*/
@@ -282,307 +330,651 @@ tools getSuper(FILE *image, int part, int subpart)
   /*Save into our file tools*/
   target->zonesPerBlock = temp;
   
-  /*Save file pointer to target*/
-  target->image = image;
+  /*Save the image to target*/
+  target->map = map;
+
+  /*Copy at most this much at once until someone says otherwise*/
+  target->maxIO = MAX_IO;
+
+  /*Let the kernel do the copying if the image is a real file (and not a
+   *compressed one)*/
+  target->zeroCopy = map->mapped || (!map->direct && !map->zimg);
+
+  /*Start with a default sized inode cache*/
+  target->icache = NULL;
+  setInodeCache(target, INODE_CACHE);
+
+  /*No directories have been indexed yet*/
+  target->indexes = NULL;
+  setIndexCap(target, INDEX_CAP);
+
+  /*Nor have any paths been looked up*/
+  target->dentries = NULL;
+  clearDentries(target);
+
+  /*Where files will go*/
+  target->mem = makeArena(ARENA_BLOCK);
+
+  traceSpan(start, "getSuper", NULL,
+	    "\"offset\":%ld,\"blocksize\":%u,\"zonesize\":%d",
+	    target->offset, target->superblock->blocksize, target->zonesize);
   
   return target;
 }
 
-/*This function reads and returns a pointer to desired the inode struct*/
-inode getInode(tools target, int iNum)
+/*Frees an inode cache made by setInodeCache*/
+void freeInodeCache(iCache cache)
 {
-  inode targetInode;
-  long ltemp;
+  int i;
 
-  /*Counting starts at 1, to skip the necessary amount of inodes, we minus 1*/
-  ltemp = target->inodeOff + ((iNum-1) * INODE_SIZE);
-  
-  /*Seek to the location of the inode in filesystem*/
-  if( fseek(target->image, ltemp, SEEK_SET) != 0 )
+  if(!cache)
+    return;
+
+  for(i = 0; i < cache->numSlots; i++)
+    free(cache->slots[i].buffer);
+
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->slotOf);
+  free(cache->slots);
+  free(cache);
+}
+
+/*This function (re)sizes the inode cache to hold the given number of inode
+ *table blocks. Anything cached before is dropped.*/
+void setInodeCache(tools target, int blocks)
+{
+  iCache cache;
+  uint32_t i;
+
+  /*Need at least one block to have anywhere to put an inode*/
+  if(blocks < 1)
+    blocks = 1;
+
+  freeInodeCache(target->icache);
+
+  cache = malloc(sizeof(struct inode_cache));
+  cache->numSlots = blocks;
+  cache->hand = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+
+  /*Number of blocks the inode table takes up*/
+  cache->numBlocks = ((long)target->superblock->ninodes * INODE_SIZE +
+		      target->superblock->blocksize - 1) /
+    target->superblock->blocksize;
+
+  /*Nothing is cached yet*/
+  cache->slotOf = malloc(sizeof(int) * cache->numBlocks);
+  for(i = 0; i < cache->numBlocks; i++)
+    cache->slotOf[i] = -1;
+
+  cache->slots = calloc(blocks, sizeof(struct cache_slot));
+  pthread_mutex_init(&cache->lock, NULL);
+
+  /*If the image isn't in memory, each slot needs a block of its own*/
+  if(!target->map->direct)
+    for(i = 0; i < blocks; i++)
+      cache->slots[i].buffer = malloc(target->superblock->blocksize);
+
+  target->icache = cache;
+}
+
+/*Finds a slot for the given inode table block, evicting whatever the clock
+ *hand lands on first that hasn't been used since the last sweep*/
+static cacheSlot loadInodeBlock(tools target, uint32_t block)
+{
+  iCache cache;
+  cacheSlot slot;
+
+  cache = target->icache;
+
+  while(1)
   {
-    /*fseek failed*/
-    perror("getInode - fseek");
-    exit(EXIT_FAILURE);
+    slot = &cache->slots[cache->hand];
+    cache->hand = (cache->hand + 1) % cache->numSlots;
+
+    /*Recently used, give it another lap*/
+    if(slot->used && slot->ref)
+    {
+      slot->ref = 0;
+      continue;
+    }
+
+    /*Evict whatever was here, so a failed read leaves the slot empty*/
+    if(slot->used)
+      cache->slotOf[slot->block] = -1;
+    slot->used = 0;
+    break;
   }
 
-  /*Allocate memory for the inode*/
-  targetInode = malloc(sizeof(struct inode));
-  
-  /*Lift the inode data out of the image*/
-  if( !fread(targetInode, INODE_SIZE, 1, target->image) )
-  {
-    /*fread failed*/
-    perror("getTools super - fread");
-    exit(EXIT_FAILURE);
-  }  
-  
-  return targetInode;
+  /*Load the whole block at once*/
+  slot->data = imgRead(target->map, target->inodeOff +
+		       (long)block * target->superblock->blocksize,
+		       target->superblock->blocksize, slot->buffer, IO_INODE);
+  slot->block = block;
+  slot->used = 1;
+  slot->ref = 1;
+
+  cache->slotOf[block] = slot - cache->slots;
+
+  return slot;
 }
 
-/*This function, given a zone number, goes to that zone and copies the entire
- *zone into the given buffer*/
-void readZone(tools target, char *buffer, int zoneNum)
+/*This function copies the desired inode into scratch and returns it. Inodes
+ *are served out of the inode cache, which loads whole inode table blocks.
+ *The copy is made while the cache is locked, so the block can't be evicted
+ *out from under it.*/
+inode getInode(tools target, int iNum, inode scratch)
 {
+  iCache cache;
+  cacheSlot slot;
   long ltemp;
+  uint32_t block;
+  jmp_buf damaged, *outer;
 
-  ltemp = target->offset + (zoneNum * target->zonesize);
-  
-  /*Seek to the location of the zone in filesystem*/
-  if( fseek(target->image, ltemp, SEEK_SET) != 0 )
+  cache = target->icache;
+
+  /*Inodes are numbered starting at 1*/
+  if(iNum < 1 || iNum > target->superblock->ninodes)
   {
-    /*fseek failed*/
-    perror("readZone - fseek");
-    exit(EXIT_FAILURE);
+    fprintf(stderr, "getInode - bad inode number %d\n", iNum);
+    imgFail();
   }
 
-  /*Read the contents of the entire zone and stuff it into the buffer*/
-  if( !fread(buffer, sizeof(char), target->zonesize, target->image) )
+  /*Counting starts at 1, to skip the necessary amount of inodes, we minus 1*/
+  ltemp = (long)(iNum-1) * INODE_SIZE;
+  block = ltemp / target->superblock->blocksize;
+
+  /*Check the cache before loading anything*/
+  pthread_mutex_lock(&cache->lock);
+  if(cache->slotOf[block] >= 0)
   {
-    /*fread failed*/
-    perror("readZone - fread");
-    exit(EXIT_FAILURE);
+    slot = &cache->slots[cache->slotOf[block]];
+    slot->ref = 1;
+    cache->hits++;
   }
+  else
+  {
+    /*The block can still fail to read (I/O errors, damaged compressed
+     *images), and that mustn't leave the cache locked*/
+    outer = catchDamage(&damaged);
+    if( setjmp(damaged) )
+    {
+      pthread_mutex_unlock(&cache->lock);
+      catchDamage(outer);
+      imgFail();
+    }
+
+    slot = loadInodeBlock(target, block);
+    catchDamage(outer);
+    cache->misses++;
+  }
+
+  memcpy(scratch, slot->data + ltemp % target->superblock->blocksize,
+	 sizeof(struct inode));
+  pthread_mutex_unlock(&cache->lock);
+  
+  return scratch;
+}
+
+/*This function, given a zone number, returns a pointer to the start of that
+ *zone. scratch must hold a zone, it is only used if the image isn't in
+ *memory.*/
+char *readZone(tools target, int zoneNum, char *scratch)
+{
+  long ltemp;
+
+  ltemp = target->offset + ((long)zoneNum * target->zonesize);
+  
+  return imgRead(target->map, ltemp, target->zonesize, scratch, IO_ZONE);
 }
 
 /*Similar to readZone, but with blocks instead. Mostly useful for only
  *reading the first block of a zone, because only the first block of an 
  *indirect/2-indirect zone has zone numbers in it.*/
-void readBlock(tools target, void *buffer, int zoneNum)
+void *readBlock(tools target, int zoneNum, void *scratch)
+{
+  long ltemp;
+
+  ltemp = target->offset + ((long)zoneNum * target->zonesize);
+  
+  return imgRead(target->map, ltemp, target->superblock->blocksize, scratch,
+		 IO_BLOCK);
+}
+
+/*Another variation, given a zone and file number, returns a pointer to that
+ *fileEnt (in the image, or in scratch)*/
+fileEnt readFEnt(tools target, int zoneNum, int fIndex, fileEnt scratch)
 {
   long ltemp;
 
-  ltemp = target->offset + (zoneNum * target->zonesize);
+  ltemp = target->offset + ((long)zoneNum * target->zonesize) +
+    (fIndex * DIR_SIZE);
   
-  /*Seek to the location of the zone in filesystem*/
-  if( fseek(target->image, ltemp, SEEK_SET) != 0 )
+  return imgRead(target->map, ltemp, DIR_SIZE, scratch, IO_FENT);
+}
+
+/*Adds count zones starting at zone number start (0 for a hole) to the end
+ *of the extent map, growing the last run if the new zones continue it*/
+static void addZones(extMap map, uint32_t start, uint32_t count)
+{
+  extent last;
+
+  if(count == 0)
+    return;
+
+  /*See if this continues the last run*/
+  if(map->numRuns > 0)
   {
-    /*fseek failed*/
-    perror("readBlock - fseek");
-    exit(EXIT_FAILURE);
+    last = &map->runs[map->numRuns - 1];
+
+    /*Holes continue holes, zones continue if they are physically next*/
+    if( (last->hole && start == 0) ||
+	(!last->hole && start != 0 && last->start + last->len == start) )
+    {
+      last->len += count;
+      map->numZones += count;
+      return;
+    }
   }
 
-  /*Read the contents of the first block of the zone and stuff it into 
-   *the buffer*/
-  if( !fread(buffer, sizeof(char),
-	       target->superblock->blocksize, target->image) )
+  /*Otherwise start a new run, making room for it if needed. Arena maps
+   *leave the old list behind, it goes with the arena.*/
+  if(map->numRuns == map->maxRuns)
   {
-    /*fread failed*/
-    perror("readBlock - fread");
-    exit(EXIT_FAILURE);
+    map->maxRuns = map->maxRuns ? map->maxRuns * 2 : 8;
+    if(map->mem)
+    {
+      last = arenaAlloc(map->mem, sizeof(struct extent) * map->maxRuns);
+      if(map->numRuns > 0)
+	memcpy(last, map->runs, sizeof(struct extent) * map->numRuns);
+      map->runs = last;
+    }
+    else
+      map->runs = realloc(map->runs, sizeof(struct extent) * map->maxRuns);
   }
+
+  last = &map->runs[map->numRuns++];
+  last->logical = map->first + map->numZones;
+  last->start = start;
+  last->len = count;
+  last->hole = (start == 0);
+  
+  map->numZones += count;
 }
 
-/*Another variation, given a zone and file number, seeks to that position and
- *reads a fileEnt sized chunk of data*/
-void readFEnt(tools target, fileEnt buffer, int zoneNum, int fIndex)
+/*Adds count zones listed in an indirect block, starting with entry skip.
+ *A missing indirect block is one big hole. scratch holds a block, in case
+ *it has to be read.*/
+static void addIndirect(tools target, extMap map, uint32_t zoneNum,
+			uint32_t skip, uint32_t count, void *scratch)
 {
-  long ltemp;
+  uint32_t *indirect, i;
 
-  ltemp = target->offset + (zoneNum * target->zonesize) + (fIndex * DIR_SIZE);
-  
-  /*Seek to the location of the zone in filesystem*/
-  if( fseek(target->image, ltemp, SEEK_SET) != 0 )
+  if(zoneNum == 0)
   {
-    /*fseek failed*/
-    perror("readFEnt - fseek");
-    exit(EXIT_FAILURE);
+    addZones(map, 0, count);
+    return;
   }
 
-  /*Read the contents of the first block of the zone and stuff it into 
-   *the buffer*/
-  if( !fread(buffer, DIR_SIZE, 1, target->image) )
-  {
-    /*fread failed*/
-    perror("readFEnt - fread");
-    exit(EXIT_FAILURE);
-  }
+  indirect = readBlock(target, zoneNum, scratch);
+
+  for(i = 0; i < count; i++)
+    addZones(map, indirect[skip + i], 1);
 }
 
-/*This function returns the zone number for a given index*/
-uint32_t getZoneNum(tools target, inode folder, int zoneNum)
+/*This function walks the zone list, indirect and two_indirect blocks of the
+ *given inode exactly once and builds the list of runs that make up the
+ *file. Every reader goes through this instead of looking up zones itself.
+ *The map comes out of mem if one is given, otherwise it is malloced.*/
+extMap getExtents(tools target, inode file, arena mem)
 {
-  uint32_t indirect[target->zonesPerBlock],
-    two_indirect[target->zonesPerBlock];
-  int two_index, one_index;
-  
-  /*If the zone is directly available*/
-  if(zoneNum < DIRECT_ZONES)
-    return folder->zone[zoneNum];
+  return getExtentRange(target, file, mem, 0, UINT32_MAX);
+}
 
-  /*If we have to get into the direct zones*/
-  else if(zoneNum < DIRECT_ZONES + target->zonesPerBlock)
+/*Like getExtents, but only for count zones of the file starting at zone
+ *first (cut short at the end of the file). Only the indirect blocks that
+ *list zones in the range are read, so a range near the end of a huge file
+ *costs the two_indirect block and one indirect block or so.*/
+extMap getExtentRange(tools target, inode file, arena mem, uint32_t first,
+		      uint32_t count)
+{
+  extMap map;
+  uint32_t zones, end, perBlock, *two_indirect, i, lo, hi, base;
+  char *scratch;
+
+  map = mem ? arenaAlloc(mem, sizeof(struct extent_map)) :
+    malloc(sizeof(struct extent_map));
+  map->mem = mem;
+  map->first = first;
+  map->numZones = 0;
+  map->numRuns = 0;
+  map->maxRuns = 0;
+  map->runs = NULL;
+
+  /*Number of zones the file covers (the last one may be partial)*/
+  zones = (file->size + target->zonesize - 1) / target->zonesize;
+  perBlock = target->zonesPerBlock;
+
+  /*The range is [first, end)*/
+  if(first >= zones)
+    return map;
+  end = count < zones - first ? first + count : zones;
+
+  /*Room for the two_indirect block and one indirect block at a time*/
+  scratch = NULL;
+  if(!target->map->direct && end > DIRECT_ZONES)
+    scratch = mem ? arenaAlloc(mem, 2 * target->superblock->blocksize) :
+      malloc(2 * target->superblock->blocksize);
+
+  /*Direct zones first*/
+  for(i = first; i < DIRECT_ZONES && i < end; i++)
+    addZones(map, file->zone[i], 1);
+
+  /*Then whatever the indirect zone covers*/
+  lo = first > DIRECT_ZONES ? first : DIRECT_ZONES;
+  hi = end < DIRECT_ZONES + perBlock ? end : DIRECT_ZONES + perBlock;
+  if(lo < hi)
+    addIndirect(target, map, file->indirect, lo - DIRECT_ZONES, hi - lo,
+		scratch);
+
+  /*Then each indirect zone listed in the two_indirect zone*/
+  base = DIRECT_ZONES + perBlock;
+  lo = first > base ? first : base;
+  if(lo < end)
   {
-    /*If the indirect zone is 0, then its always going to be zero*/
-    if(folder->indirect == 0)
-      return 0;
-    /*Otherwise get the zone number from the indirect zone*/
+    /*No two_indirect zone means everything left is a hole*/
+    if(file->two_indirect == 0)
+      addZones(map, 0, end - lo);
     else
     {
-      /*Read the indirect list of zones*/
-      readBlock(target, indirect, folder->indirect);
+      two_indirect = readBlock(target, file->two_indirect,
+			       scratch ? scratch + target->superblock->blocksize
+			       : NULL);
+
+      /*Only the indirect zones that overlap the range*/
+      for(i = (lo - base) / perBlock; i < perBlock && lo < end; i++)
+      {
+	hi = base + (i + 1) * perBlock;
+	if(hi > end)
+	  hi = end;
 
-      return indirect[zoneNum - DIRECT_ZONES];
+	addIndirect(target, map, two_indirect[i],
+		    lo - (base + i * perBlock), hi - lo, scratch);
+	lo = hi;
+      }
     }
   }
 
-  /*If we have to get into the twice indirect zones*/
-  else
-  {
-    if(folder->two_indirect == 0)
-      return 0;
-    /*Assuming that n goes to an index inside of the two_indirect block, the
-     *range of that block can be represented:
-      
-      [n] covers (n+1)zPB + 7 throught (n+2)zPB + 6
+  if(!mem)
+    free(scratch);
+  return map;
+}
 
-     */
-    else
-    {
-      /*Read the two_indirect list of indirect zones*/
-      readBlock(target, two_indirect, folder->two_indirect);
+/*Frees an extent map made by getExtents (one from an arena goes when the
+ *arena does)*/
+void freeExtents(extMap map)
+{
+  if(!map || map->mem)
+    return;
 
-      /*Find the index for the two_indirect zone*/
-      two_index = (zoneNum - (target->zonesPerBlock + 7))
-	      / target->zonesPerBlock;
+  free(map->runs);
+  free(map);
+}
 
-      /*If the indirect zone number is 0, return 0*/
-      if(two_indirect[two_index] == 0)
-	      return 0;
+/*This function returns the zone number for a given index, 0 if it is a hole
+ *or past the end of the file*/
+uint32_t getZoneNum(extMap map, uint32_t zoneNum)
+{
+  int low, high, mid;
+  extent run;
 
-      /*Find the index for the one_indirect zone*/
-      one_index = zoneNum -
-	      ((two_index + 1) * target->zonesPerBlock + DIRECT_ZONES);
-      
-      /*Index the two_indirect block and read that zone*/
-      readBlock(target, indirect, two_indirect[two_index]);
+  /*Binary search for the run holding this zone*/
+  low = 0;
+  high = map->numRuns - 1;
 
-      /*Return the zone number at the one_index*/
-      return indirect[one_index];
-    }
+  while(low <= high)
+  {
+    mid = (low + high) / 2;
+    run = &map->runs[mid];
+
+    if(zoneNum < run->logical)
+      high = mid - 1;
+    else if(zoneNum >= run->logical + run->len)
+      low = mid + 1;
+    else
+      return run->hole ? 0 : run->start + (zoneNum - run->logical);
   }
+
+  return 0;
 }
 
-/*For a given (directory) inode and file name, this function attempts 
- *to find the matching file*/
-fileEnt getMatch(tools target, inode folder, int numFiles, char *string)
+/*Starts walking the entries of a directory. Entries are handed out one zone
+ *at a time, so each zone of the directory is only looked up once. The
+ *iterator comes out of mem if one is given, otherwise it is malloced.*/
+dirIter openDir(tools target, inode folder, arena mem)
 {
-  int i, fileInZone, zoneCount;
-  fileEnt file;
-  uint32_t currentZone;
+  dirIter iter;
+
+  iter = mem ? arenaAlloc(mem, sizeof(struct dir_iter)) :
+    malloc(sizeof(struct dir_iter));
+  iter->target = target;
+  iter->mem = mem;
+  iter->map = getExtents(target, folder, mem);
+  iter->numSlots = folder->size / DIR_SIZE;
+  iter->slot = 0;
+  iter->run = 0;
+  iter->zone = 0;
+  iter->inZone = target->filePerZone;
+  iter->entries = NULL;
+
+  /*Only needed if zones can't be pointed at in memory*/
+  iter->buffer = NULL;
+  if(!target->map->direct)
+    iter->buffer = mem ? arenaAlloc(mem, target->zonesize) :
+      malloc(target->zonesize);
+
+  return iter;
+}
 
-  /*Linear count of zones*/
-  zoneCount = 0;
-  
-  /*Get the very first zone*/
-  currentZone = getZoneNum(target, folder, zoneCount);
+/*Returns the next entry in the directory that is in use, or NULL once
+ *every slot has been looked at*/
+fileEnt nextEnt(dirIter iter)
+{
+  tools target;
+  extent run;
+  fileEnt file;
 
-  /*Starting at the first file entry in the zone*/
-  fileInZone = 0;
+  target = iter->target;
 
-  file = malloc(DIR_SIZE);
-  
-  /*Attempt to read numFiles amount of fileEnts from the inode's zones*/
-  for(i = 0; i < numFiles; i++)
+  while(iter->slot < iter->numSlots)
   {
-    /*If the zone is 0, we don't actually need to do reading*/
-    if(currentZone == 0)
+    /*Done with this zone, move on to the next one*/
+    if(iter->inZone == target->filePerZone)
     {
-      /*Grab next zone*/
-      currentZone = getZoneNum(target, folder, ++zoneCount);
+      /*Past the end of the directory's zones*/
+      if(iter->run >= iter->map->numRuns)
+	return NULL;
 
-      /*Turn back the clock and try another read, since inode 0 is invalid*/
-      i -= 1;
-    }
-    else
-    {
-      /*Grab the file related file entry*/
-      /*Not the most elegant because this seeks to the folder everytime*/
-      readFEnt(target, file, currentZone, fileInZone);
+      run = &iter->map->runs[iter->run];
 
-      /*If the inode is 0, the entry is invalid. Don't count it*/
-      if(file->inode == 0)
+      /*Holes don't have any entries in them, but they still take up room*/
+      if(run->hole)
       {
-	      /*Redo the file read*/
-	      i -= 1;
+	iter->slot += run->len * target->filePerZone;
+	iter->run++;
+	continue;
       }
-      else
+
+      /*Grab the whole zone of entries at once*/
+      iter->entries = (fileEnt)readZone(target, run->start + iter->zone,
+					iter->buffer);
+      iter->inZone = 0;
+
+      /*Step to the next zone (and maybe the next run) for next time*/
+      if(++iter->zone == run->len)
       {
-	      /*Compare at most the first 60 bytes of the two file names*/
-	      if( strncmp(string, (char *) file->name, 60) == 0 )
-	        /*If they match, return the file*/
-	        return file;
-
-	      /*If max number of fileEnts in a zone, reset, grab new zone*/
-	      if(++fileInZone == target->filePerZone)
-	      {
-	        /*Reset file in zone*/
-	        fileInZone = 0;
-	
-	        /*Grab next zone number*/
-	        currentZone = getZoneNum(target, folder, ++zoneCount);
-	      }
+	iter->zone = 0;
+	iter->run++;
       }
-    }      
+    }
+
+    file = &iter->entries[iter->inZone++];
+    iter->slot++;
+
+    /*If the inode is 0, the entry is invalid. Skip it*/
+    if(file->inode != 0)
+      return file;
   }
 
   return NULL;
 }
 
+/*Finishes a walk started with openDir*/
+void closeDir(dirIter iter)
+{
+  if(!iter)
+    return;
 
-/*This function, given the list of folders to search through, finds the inode
- *of the desired folder, and writes it to the target*/
-int findFolder(tools target, char **path, int depth)
+  freeExtents(iter->map);
+
+  /*Anything from an arena goes when the arena does*/
+  if(!iter->mem)
+  {
+    free(iter->buffer);
+    free(iter);
+  }
+}
+
+/*For a given (directory) inode number and file name, this function attempts
+ *to find the matching file and returns its inode number, or 0 if there
+ *isn't one. Big directories get a name index the first time through,
+ *smaller ones (or any past the index cap) are just scanned. Anything the
+ *scan needs comes out of scratch.*/
+uint32_t getMatch(tools target, int dirNum, char *string, arena scratch)
 {
-  inode current;
-  int currInode, numFiles, i;
+  dirIter iter;
   fileEnt file;
+  struct inode folder;
+  uint32_t child;
+
+  getInode(target, dirNum, &folder);
+
+  /*Use the directory's index if it has or can get one*/
+  if( indexLookup(target, dirNum, &folder, string, &child, scratch) )
+    return child;
+
+  child = 0;
+  iter = openDir(target, &folder, scratch);
+
+  while( (file = nextEnt(iter)) )
+  {
+    /*Compare at most the first 60 bytes of the two file names*/
+    if( strncmp(string, (char *) file->name, 60) == 0 )
+    {
+      child = file->inode;
+      break;
+    }
+  }
+
+  closeDir(iter);
+  return child;
+}
+
+
+/*This function, given the list of folders to search through, returns the
+ *inode number at the end of the path (or -1 if the path doesn't work out).
+ *Every component goes through the dentry cache first, so paths that share
+ *a prefix only search the prefix's directories once.*/
+int resolvePath(tools target, char **path, int depth)
+{
+  struct inode current;
+  int currInode, nextInode, i, cached;
+  jmp_buf damaged, *outer;
+  arena scratch;
+  double start;
 
   /*Get the root inode first*/
   currInode = 1;
 
+  /*Scratch memory for searching, reused for every component, and freed
+   *if a directory on the way turns out to be damaged*/
+  scratch = makeArena(ARENA_BLOCK);
+  outer = catchDamage(&damaged);
+  if( setjmp(damaged) )
+  {
+    catchDamage(outer);
+    freeArena(scratch);
+    imgFail();
+  }
+
   /*For each level of depth, */
   for(i = 0; i < depth; i++)
   {
-    /*Get the inode information of the currInode number*/
-    current = getInode(target, currInode);
+    start = traceStart();
 
-    /*If this is not a folder and we aren't at the end of the path, error*/
-    if(!ISDIR(current->mode) && (i != depth-1))
+    /*See if we've looked this name up in this directory before*/
+    if( !(cached = findDentry(target, currInode, path[i], &nextInode)) )
     {
-      /*If the root isn't a directory (impressive)*/
-      if(i == 0)
-	      fprintf(stderr, "Root is not a directory, impressive.\n");
-      else
-	      fprintf(stderr, "\'%s\' is not a directory.\n", path[i-1]);
-      return -1;
-    }
+      /*Get the inode information of the currInode number*/
+      getInode(target, currInode, &current);
 
-    /*Find number of files in current folder*/
-    numFiles = current->size / DIR_SIZE;
+      /*We can only look for things inside of a folder*/
+      if(!ISDIR(current.mode))
+      {
+	/*If the root isn't a directory (impressive)*/
+	if(i == 0)
+	  fprintf(stderr, "Root is not a directory, impressive.\n");
+	else
+	  fprintf(stderr, "\'%s\' is not a directory.\n", path[i-1]);
+	catchDamage(outer);
+	freeArena(scratch);
+	return -1;
+      }
 
-    /*Find a match for the given string in the path*/
-    file = getMatch(target, current, numFiles, path[i]);
+      /*Find a match for the given string in the path*/
+      nextInode = getMatch(target, currInode, path[i], scratch);
+      resetArena(scratch);
+
+      /*Remember the answer, even if there wasn't one*/
+      addDentry(target, currInode, path[i], nextInode);
+    }
+
+    traceSpan(start, "resolve", path[i],
+	      "\"parent\":%d,\"inode\":%d,\"cached\":%d",
+	      currInode, nextInode, cached);
 
     /*If there was no match, then the path was invalid*/
-    if(!file)
+    if(nextInode == 0)
     {
       fprintf(stderr, "Could not file \'%s\' in path\n", path[i]);
+      catchDamage(outer);
+      freeArena(scratch);
       return -1;
     }
 
     /*Mark this file as the next current inode*/
-    currInode = file->inode;
-
-    /*We only needed its inode number*/
-    free(file);
+    currInode = nextInode;
   }
 
-  /*If we haven't returned an error, we likely found the inode we want*/
-  /*Allocate memory and save the inode structure*/
-  target->inode = getInode(target, currInode);
+  catchDamage(outer);
+  freeArena(scratch);
+  return currInode;
+}
+
+/*This function, given the list of folders to search through, finds the inode
+ *of the desired folder, and writes it to the target*/
+int findFolder(tools target, char **path, int depth)
+{
+  int currInode;
 
-  /*Save a string of its permissions*/
-  target->perms = getMode(target->inode->mode);
+  if( (currInode = resolvePath(target, path, depth)) < 0 )
+    return -1;
+
+  /*If we haven't returned an error, we likely found the inode we want*/
+  /*Save the inode structure*/
+  target->iNum = currInode;
+  target->inode = getInode(target, currInode, &target->inodeBuf);
 
   /*If this is a folder, save the number of files in this directory*/
   target->numFiles = ISDIR(target->inode->mode) ?
@@ -592,106 +984,942 @@ int findFolder(tools target, char **path, int depth)
   return 0;
 }
 
-/*Read entire contents of the directory in the target inode*/
-void getContents(tools target)
+/*Reads every entry of the given directory into a new listing. The listing,
+ *everything in it and the walk come out of mem, so freeing mem frees it all.
+ *Nothing in the tools is changed, so any number of threads can do this at
+ *once.*/
+dirList readListing(tools target, inode folder, arena mem)
 {
-  int i, zoneNum, fileOffset;
+  int slots, len;
+  long used;
   fileEnt currentEntry;
-  inode currentInode;
+  struct inode currentInode;
+  dirIter iter;
+  dirList list;
+  double start;
+
+  start = traceStart();
+
+  /*The listing can't be longer than the slots, so make room for that*/
+  slots = folder->size / DIR_SIZE;
+  list = arenaAlloc(mem, sizeof(struct dir_listing));
+  list->count = 0;
+  list->inodes = arenaAlloc(mem, sizeof(uint32_t) * slots);
+  list->modes = arenaAlloc(mem, sizeof(uint16_t) * slots);
+  list->sizes = arenaAlloc(mem, sizeof(uint32_t) * slots);
+  list->nameOff = arenaAlloc(mem, sizeof(uint32_t) * slots);
+  list->names = arenaAlloc(mem, (long)slots * 61);
+  used = 0;
+
+  iter = openDir(target, folder, mem);
+    
+  while( (currentEntry = nextEnt(iter)) )
+  {
+    /*Get the inode for the other info*/
+    getInode(target, currentEntry->inode, &currentInode);
+
+    /*Save the information*/
+    list->inodes[list->count] = currentEntry->inode;
+    list->modes[list->count] = currentInode.mode;
+    list->sizes[list->count] = currentInode.size;
+
+    /*Names may fill all 60 bytes, so they get a nul-byte of their own*/
+    len = strnlen((char *)currentEntry->name, 60);
+    memcpy(list->names + used, currentEntry->name, len);
+    list->names[used + len] = '\0';
+    list->nameOff[list->count++] = used;
+    used += len + 1;
+  }
 
-  /*Allocate memory for the list*/
-  target->files = malloc(sizeof(dirEnt) * target->numFiles);
-  
-  /*Read numFiles amount of entries from the directory*/
-  for(i = 0; i < target->numFiles; i++)
+  closeDir(iter);
+
+  traceSpan(start, "readListing", NULL, "\"slots\":%d,\"entries\":%d",
+	    slots, list->count);
+
+  return list;
+}
+
+/*What a listing is sorted on: a key that orders most entries by itself,
+ *and the entry it belongs to*/
+typedef struct sort_key
+{
+  uint64_t key;
+  uint32_t entry;
+} *sortKey;
+
+/*Puts the first 8 bytes of a name in a number that sorts the same way*/
+static uint64_t namePrefix(char *name)
+{
+  uint64_t prefix;
+  int i;
+
+  prefix = 0;
+  for(i = 0; i < 8; i++)
   {
-    /*Get the proper zone number*/
-    zoneNum = getZoneNum(target, target->inode, i/target->filePerZone);
-    /*Calculate the directory offset in the zone*/
-    fileOffset = i % target->filePerZone;
+    prefix <<= 8;
+    if(*name)
+      prefix |= (unsigned char)*name++;
+  }
 
-    /*Allocate memory for the fileEnt*/
-    currentEntry = malloc(DIR_SIZE);
-    
-    /*Read that fileEnt*/
-    readFEnt(target, currentEntry, zoneNum, fileOffset);
+  return prefix;
+}
+
+/*Compares two sort keys. Only names whose first 8 bytes match need to be
+ *looked at, and equal entries stay in directory order.*/
+static int compareKeys(const void *a, const void *b, void *arg)
+{
+  sortKey keyA, keyB;
+  dirList list;
+  int diff;
+
+  keyA = (sortKey)a;
+  keyB = (sortKey)b;
+  list = arg;
+
+  if(keyA->key != keyB->key)
+    return keyA->key < keyB->key ? -1 : 1;
 
-    /*If the inode is 0*/
-    if(currentEntry->inode == 0)
+  if(list && (diff = strcmp(LISTNAME(list, keyA->entry),
+			    LISTNAME(list, keyB->entry))) != 0)
+    return diff;
+
+  return keyA->entry < keyB->entry ? -1 : (keyA->entry > keyB->entry);
+}
+
+/*Sorts a listing by name or by size (largest first). Only the keys are
+ *sorted, then each array is put in the new order in one pass. The names
+ *themselves never move. The new arrays come out of mem.*/
+void sortListing(dirList list, int order, arena mem)
+{
+  struct sort_key *keys;
+  uint32_t *inodes, *sizes, *nameOff;
+  uint16_t *modes;
+  int i;
+
+  if(order == SORT_NONE || list->count < 2)
+    return;
+
+  keys = malloc(sizeof(struct sort_key) * list->count);
+
+  for(i = 0; i < list->count; i++)
+  {
+    keys[i].entry = i;
+    if(order == SORT_SIZE)
+      keys[i].key = UINT32_MAX - list->sizes[i];
+    else
+      keys[i].key = namePrefix(LISTNAME(list, i));
+  }
+
+  qsort_r(keys, list->count, sizeof(struct sort_key), compareKeys,
+	  order == SORT_NAME ? list : NULL);
+
+  /*Gather every array into the new order*/
+  inodes = arenaAlloc(mem, sizeof(uint32_t) * list->count);
+  modes = arenaAlloc(mem, sizeof(uint16_t) * list->count);
+  sizes = arenaAlloc(mem, sizeof(uint32_t) * list->count);
+  nameOff = arenaAlloc(mem, sizeof(uint32_t) * list->count);
+
+  for(i = 0; i < list->count; i++)
+  {
+    inodes[i] = list->inodes[keys[i].entry];
+    modes[i] = list->modes[keys[i].entry];
+    sizes[i] = list->sizes[keys[i].entry];
+    nameOff[i] = list->nameOff[keys[i].entry];
+  }
+
+  list->inodes = inodes;
+  list->modes = modes;
+  list->sizes = sizes;
+  list->nameOff = nameOff;
+
+  free(keys);
+}
+
+/*Read entire contents of the directory in the target inode. numFiles comes
+ *in as the number of entry slots and leaves as the number of entries found.*/
+void getContents(tools target)
+{
+  /*A regular file has no entries to read*/
+  if(target->numFiles > 0)
+  {
+    target->files = readListing(target, target->inode, target->mem);
+    target->numFiles = target->files->count;
+  }
+  else
+    target->files = NULL;
+}
+
+/*Adds up the set bits in words 64-bit words. Inlined into each version of
+ *countWords below, so the builtin becomes whatever that version allows.*/
+static inline __attribute__ ((always_inline)) long
+sumWords(const uint64_t *words, long numWords)
+{
+  long i, count;
+
+  count = 0;
+  for(i = 0; i < numWords; i++)
+    count += __builtin_popcountll(words[i]);
+
+  return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*With the popcnt instruction each word is one instruction*/
+__attribute__ ((target("popcnt")))
+static long countWordsPopcnt(const uint64_t *words, long numWords)
+{
+  return sumWords(words, numWords);
+}
+#endif
+
+/*Without it, gcc counts the bits of a word with a handful of shifts*/
+static long countWordsPlain(const uint64_t *words, long numWords)
+{
+  return sumWords(words, numWords);
+}
+
+/*Counts the bits set among the first bits bits of a bitmap (bit 0 is the
+ *low bit of the first byte). Whole 64-bit words are counted at once, with
+ *popcnt if the processor has it. The bitmap has to be 8-byte aligned,
+ *which anything read from a block of the image is.*/
+long countBits(unsigned char *bitmap, long bits)
+{
+  long count, numWords, i;
+
+  numWords = bits / 64;
+
+#if defined(__x86_64__) || defined(__i386__)
+  if(__builtin_cpu_supports("popcnt"))
+    count = countWordsPopcnt((const uint64_t *)bitmap, numWords);
+  else
+#endif
+    count = countWordsPlain((const uint64_t *)bitmap, numWords);
+
+  /*Then whatever is left over, a bit at a time*/
+  for(i = numWords * 64; i < bits; i++)
+    count += (bitmap[i / 8] >> (i % 8)) & 1;
+
+  return count;
+}
+
+/*Reads the whole inode bitmap. Returns a pointer to it, with *scratch set
+ *to whatever the caller has to free once done with it, and *bits to how
+ *many bits it holds.*/
+unsigned char *readInodeMap(tools target, void **scratch, long *bits)
+{
+  long bytes;
+
+  bytes = (long)target->superblock->i_blocks * target->superblock->blocksize;
+  *bits = bytes * 8;
+  *scratch = target->map->direct ? NULL : malloc(bytes);
+
+  return imgRead(target->map,
+		 target->offset + 2L * target->superblock->blocksize, bytes,
+		 *scratch, IO_BITMAP);
+}
+
+/*Counts the inodes and zones in use from the inode and zone bitmaps, which
+ *are read whole (they sit right after the superblock). Bit 0 of both is
+ *reserved; bit i of the zone bitmap is zone firstdata + i - 1. A bitmap
+ *too small for the superblock's totals only has what it holds counted.*/
+void getUsage(tools target, fsUsage usage)
+{
+  unsigned char *imap, *zmap, *scratch;
+  long blocksize, iBytes, zBytes, bits;
+  super sb;
+  double start;
+
+  start = traceStart();
+  sb = target->superblock;
+  blocksize = sb->blocksize;
+  iBytes = (long)sb->i_blocks * blocksize;
+  zBytes = (long)sb->z_blocks * blocksize;
+
+  usage->inodes = sb->ninodes;
+  usage->zones = sb->zones;
+  usage->dataZones = sb->zones > sb->firstdata ? sb->zones - sb->firstdata : 0;
+
+  /*Both bitmaps in one read*/
+  scratch = target->map->direct ? NULL : malloc(iBytes + zBytes);
+  imap = imgRead(target->map, target->offset + 2 * blocksize,
+		 iBytes + zBytes, scratch, IO_BITMAP);
+  zmap = imap + iBytes;
+
+  bits = (long)usage->inodes + 1;
+  if(bits > iBytes * 8)
+    bits = iBytes * 8;
+  usage->usedInodes = bits > 0 ? countBits(imap, bits) - (imap[0] & 1) : 0;
+
+  bits = (long)usage->dataZones + 1;
+  if(bits > zBytes * 8)
+    bits = zBytes * 8;
+  usage->usedZones = bits > 0 ? countBits(zmap, bits) - (zmap[0] & 1) : 0;
+
+  free(scratch);
+
+  traceSpan(start, "getUsage", NULL, "\"bytes\":%ld", iBytes + zBytes);
+}
+
+/*Turns the argument of --stats into a STATS_* format (a table if there is
+ *no argument), or -1 if it isn't one*/
+int statsFormat(char *arg)
+{
+  if(!arg || strcmp(arg, "table") == 0)
+    return STATS_TABLE;
+  if(strcmp(arg, "json") == 0)
+    return STATS_JSON;
+  return -1;
+}
+
+/*Dumps everything counted about reading the image to stderr, either as a
+ *table or as one JSON object. Reads are split up by who made them, and
+ *everything but file contents counts as metadata.*/
+void printStats(tools target, int format)
+{
+  imgMap map;
+  ioCount io;
+  long meta;
+  int i;
+
+  map = target->map;
+  meta = map->bytes - map->io[IO_DATA].bytes;
+
+  if(format == STATS_JSON)
+  {
+    fprintf(stderr, "{\"callers\":{");
+    for(i = 0; i < IO_CALLERS; i++)
     {
-      /*Get rid of this one*/
-      free(currentEntry);
-      
-      /*Skip this entry*/
-      i -= 1;
+      io = &map->io[i];
+      fprintf(stderr, "%s\"%s\":{\"reads\":%ld,\"preads\":%ld,"
+	      "\"seeks\":%ld,\"bytes\":%ld}", i ? "," : "", ioName(i),
+	      io->reads, io->preads, io->seeks, io->bytes);
     }
-      
-    
+    fprintf(stderr, "},\"reads\":%ld,\"preads\":%ld,\"seeks\":%ld,"
+	    "\"bytes\":%ld,\"metadata_bytes\":%ld,\"data_bytes\":%ld,",
+	    map->reads, map->preads, map->seeks, map->bytes, meta,
+	    map->io[IO_DATA].bytes);
+    if(map->zimg)
+      fprintf(stderr, "\"chunk_hits\":%ld,\"chunk_misses\":%ld,",
+	      map->zimg->hits, map->zimg->misses);
+    fprintf(stderr, "\"inode_loads\":%ld,\"inode_cache_hits\":%ld,"
+	    "\"inode_cache_misses\":%ld,\"indirect_loads\":%ld,"
+	    "\"dentry_hits\":%ld,\"dentry_misses\":%ld,"
+	    "\"dir_indexes\":%d,\"dir_index_bytes\":%ld}\n",
+	    target->icache->hits + target->icache->misses,
+	    target->icache->hits, target->icache->misses,
+	    map->io[IO_BLOCK].reads, target->dentries->hits,
+	    target->dentries->misses, target->indexes->numIndexes,
+	    target->indexes->bytes);
+    return;
+  }
+
+  fprintf(stderr, "%-10s %10s %10s %10s %14s\n", "caller", "reads", "preads",
+	  "seeks", "bytes");
+  for(i = 0; i < IO_CALLERS; i++)
+  {
+    io = &map->io[i];
+    fprintf(stderr, "%-10s %10ld %10ld %10ld %14ld\n", ioName(i), io->reads,
+	    io->preads, io->seeks, io->bytes);
+  }
+  fprintf(stderr, "%-10s %10ld %10ld %10ld %14ld\n", "total", map->reads,
+	  map->preads, map->seeks, map->bytes);
+
+  fprintf(stderr, "\nmetadata bytes:     %ld\n", meta);
+  fprintf(stderr, "data bytes:         %ld\n", map->io[IO_DATA].bytes);
+  fprintf(stderr, "inode loads:        %ld (cache hits %ld, misses %ld)\n",
+	  target->icache->hits + target->icache->misses,
+	  target->icache->hits, target->icache->misses);
+  fprintf(stderr, "indirect loads:     %ld\n", map->io[IO_BLOCK].reads);
+  fprintf(stderr, "dentry cache:       hits %ld, misses %ld\n",
+	  target->dentries->hits, target->dentries->misses);
+  fprintf(stderr, "directory indexes:  %d (%ld bytes)\n",
+	  target->indexes->numIndexes, target->indexes->bytes);
+  if(map->zimg)
+    fprintf(stderr, "chunk cache:        hits %ld, misses %ld (%u chunks)\n",
+	    map->zimg->hits, map->zimg->misses, map->zimg->numChunks);
+}
+
+/*Asks the kernel to copy len bytes at offset in the image straight to the
+ *destination, without them passing through our buffers. copy_file_range is
+ *used for regular files, sendfile for everything else (pipes, sockets). It
+ *returns how much was copied; if the kernel refuses, *zeroCopy is turned
+ *off and the caller falls back to writing the rest itself. If outOff isn't
+ *NULL, regular files are written there instead of at their position.*/
+static long kernelCopy(imgMap image, int destFd, int isFile, long offset,
+		       long len, loff_t *outOff, int *zeroCopy)
+{
+  loff_t inOff;
+  ssize_t copied;
+  long total;
+
+  inOff = offset;
+  total = 0;
+
+  while(total < len)
+  {
+    if(isFile)
+      copied = copy_file_range(image->fd, &inOff, destFd, outOff,
+			       len - total, 0);
     else
-    {
-      /*Get the inode for the other info*/
-      currentInode = getInode(target, currentEntry->inode);
+      copied = sendfile(destFd, image->fd, &inOff, len - total);
 
-      /*Allocate memory for the directory listing*/
-      target->files[i] = malloc(sizeof(struct dir_listing));
+    if(copied < 0 && errno == EINTR)
+      continue;
+
+    /*Anything else means this destination doesn't support it*/
+    if(copied <= 0)
+    {
+      /*Real write errors are still errors*/
+      if(copied < 0 && (errno == EIO || errno == ENOSPC || errno == EPIPE))
+      {
+	perror("readFile - kernel copy");
+	exit(EXIT_FAILURE);
+      }
       
-      /*Save the information*/
-      target->files[i]->entry = currentEntry;
-      target->files[i]->perms = getMode(currentInode->mode);
-      target->files[i]->size = currentInode->size;
-      strncpy(target->files[i]->name, (char *)currentEntry->name, 60);
+      *zeroCopy = 0;
+      break;
     }
+
+    /*The kernel read the image for us, it still counts*/
+    countRead(image, IO_DATA, offset + total, copied);
+    total += copied;
   }
+
+  return total;
+}
+
+/*Zeros to write for holes when the destination can't be seeked*/
+static const char zeroPage[ZERO_PAGE];
+
+/*Gets the destination past len bytes of hole. Regular files just have
+ *their position moved, so nothing is written and the hole stays a hole.
+ *Anything else gets the zeros written out.*/
+void skipHole(FILE *destination, int isFile, long len)
+{
+  long toWrite;
+
+  if(isFile)
+  {
+    /*Whatever is buffered has to land before the position moves*/
+    if( fflush(destination) != 0 )
+    {
+      perror("readFile - fflush");
+      exit(EXIT_FAILURE);
+    }
+
+    if( lseek(fileno(destination), len, SEEK_CUR) >= 0 )
+      return;
+  }
+
+  for(; len > 0; len -= toWrite)
+  {
+    toWrite = len < ZERO_PAGE ? len : ZERO_PAGE;
+
+    if( fwrite(zeroPage, sizeof(char), toWrite, destination) != toWrite )
+    {
+      perror("readFile - fwrite");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /*The kernel copy of the next run mustn't pass the zeros in the buffer*/
+  if( fflush(destination) != 0 )
+  {
+    perror("readFile - fflush");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*A hole at the very end of a regular file was only seeked over, so the
+ *file has to be made long enough to hold it*/
+void sizeForHole(FILE *destination)
+{
+  struct stat info;
+  int destFd;
+  long end;
+
+  destFd = fileno(destination);
+
+  if( fflush(destination) != 0 ||
+      (end = lseek(destFd, 0, SEEK_CUR)) < 0 ||
+      fstat(destFd, &info) < 0 ||
+      (info.st_size < end && ftruncate(destFd, end) < 0) )
+  {
+    perror("readFile - ftruncate");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*Works out the zones a range of a file covers and looks them up. *last is
+ *set to the byte just past the range (the range stops at the end of the
+ *file).*/
+static extMap rangeExtents(tools target, inode file, long offset,
+			   long length, long *last)
+{
+  *last = length < file->size - offset ? offset + length : file->size;
+
+  return getExtentRange(target, file, NULL, offset / target->zonesize,
+			(*last - 1) / target->zonesize -
+			offset / target->zonesize + 1);
+}
+
+/*Where a run of a range starts (skip bytes into it) and how much of it is
+ *in the range. The first and last runs may stick out of the range, and
+ *the last one may also be a partial zone.*/
+static long runInRange(tools target, extent run, long offset, long last,
+		       long *skip)
+{
+  long runEnd;
+
+  *skip = offset - (long)run->logical * target->zonesize;
+  if(*skip < 0)
+    *skip = 0;
+  runEnd = (long)(run->logical + run->len) * target->zonesize;
+  if(runEnd > last)
+    runEnd = last;
+
+  return runEnd - (long)run->logical * target->zonesize - *skip;
 }
 
 /*This function copies the entirety of a given file from the minix image to
- *the specified destination*/
-void readFile(tools target, FILE *destination)
+ *the specified destination. Zones that are next to each other on disk are
+ *copied together, at most maxIO bytes at a time. When possible the kernel
+ *copies the data directly from the image to the destination. Holes are
+ *seeked over on regular files and written as zeros to anything else.*/
+void readFile(tools target, inode file, FILE *destination)
 {
-  char *buffer;
-  int i, zones, toRead, remainder;
+  readRange(target, file, destination, 0, file->size);
+}
 
-  /*Calculate the number of full zones we need to copy*/
-  zones = target->inode->size / target->zonesize;
+/*Copies length bytes of the file starting at byte offset (anything past the
+ *end of the file is left off) the same way readFile copies all of it. Only
+ *the zones that overlap the range are looked up and read.*/
+void readRange(tools target, inode file, FILE *destination, long offset,
+	       long length)
+{
+  char *buffer, *scratch;
+  int i, destFd, isFile, zeroCopy;
+  long runOff, runBytes, skip, toWrite, imgOff, done, last;
+  struct stat info;
+  extMap map;
+  extent run;
+  double start;
+
+  if(offset < 0 || offset >= file->size || length <= 0)
+    return;
+
+  map = rangeExtents(target, file, offset, length, &last);
+
+  /*Chunks get read here if the image isn't in memory*/
+  scratch = target->map->direct ? NULL : malloc(target->maxIO);
+
+  /*Figure out what kind of destination this is, for holes and for the
+   *kernel copy*/
+  destFd = fileno(destination);
+  zeroCopy = target->zeroCopy;
+  if( fstat(destFd, &info) < 0 )
+  {
+    isFile = 0;
+    zeroCopy = 0;
+  }
+  else
+    isFile = S_ISREG(info.st_mode);
 
-  /*Calculate any remainder in the file*/
-  remainder = target->inode->size % target->zonesize;
-  
-  /*Allocate buffer that is one zone's worth of bytes*/
-  buffer = malloc(target->zonesize);
+  /*Anything already buffered has to go out first to keep the order*/
+  if( zeroCopy && fflush(destination) != 0 )
+  {
+    perror("readFile - fflush");
+    exit(EXIT_FAILURE);
+  }
 
-  /*Go through zones amount of full zones*/
-  for(i = 0; i <= zones; i++)
+  /*Go through each run of zones in the file*/
+  for(i = 0; i < map->numRuns; i++)
   {
-    /*Get actual zone number*/
-    toRead = getZoneNum(target, target->inode, i);
+    run = &map->runs[i];
+    start = traceStart();
+    runBytes = runInRange(target, run, offset, last, &skip);
 
-    /*Check if zone 0*/
-    if(toRead != 0)
+    /*Holes have nothing to read, but still take up room in the file*/
+    if(run->hole)
     {
-      /*Read zone into the buffer*/
-      readZone(target, buffer, toRead);
+      skipHole(destination, isFile, runBytes);
+      traceSpan(start, "hole", NULL, "\"logical\":%u,\"bytes\":%ld",
+		run->logical, runBytes);
+      continue;
+    }
+
+    /*Copy the run in chunks of at most maxIO bytes*/
+    for(runOff = 0; runOff < runBytes; runOff += toWrite)
+    {
+      toWrite = runBytes - runOff;
+      if(toWrite > target->maxIO)
+	toWrite = target->maxIO;
+
+      imgOff = target->offset + (long)run->start * target->zonesize + skip +
+	runOff;
+
+      /*Try to have the kernel do it, then write whatever is left*/
+      done = 0;
+      if(zeroCopy)
+	done = kernelCopy(target->map, destFd, isFile, imgOff, toWrite, NULL,
+			  &zeroCopy);
+
+      if(done == toWrite)
+	continue;
+
+      buffer = imgRead(target->map, imgOff + done, toWrite - done, scratch,
+		       IO_DATA);
 
-      if(i == zones)
+      if( fwrite(buffer, sizeof(char), toWrite - done, destination)
+	  != toWrite - done )
       {
-	      /*Write only the remainder to the destination*/
-	      if( fwrite(buffer, sizeof(char), remainder, destination)
-	          != remainder)
-	      {
-	        perror("readFile - fwrite");
-	        exit(EXIT_FAILURE);
-	      }
+	perror("readFile - fwrite");
+	exit(EXIT_FAILURE);
       }
-      else
+    }
+
+    traceSpan(start, "extent", NULL,
+	      "\"logical\":%u,\"zone\":%u,\"bytes\":%ld",
+	      run->logical, run->start, runBytes);
+  }
+
+  if(isFile && map->numRuns > 0 && map->runs[map->numRuns - 1].hole)
+    sizeForHole(destination);
+
+  free(scratch);
+  freeExtents(map);
+}
+
+/*One buffer in a read pipeline: a chunk of the file, a hole, or the end*/
+typedef struct pipe_slot
+{
+  char *data;  /*Buffer chunks are read into (NULL if the image is in memory)*/
+  char *chunk; /*The chunk itself*/
+  long len;    /*Bytes in the chunk, or in the hole*/
+  int hole;    /*1 if this stands in for a hole*/
+  int end;     /*1 if the copy is over*/
+} *pipeSlot;
+
+/*The reader and writer stages of a pipelined copy and the ring of buffers
+ *between them. The reader fills slots in order and the writer empties them
+ *in the same order, so only the count of filled slots is shared.*/
+typedef struct read_pipe
+{
+  tools target;
+  extMap map;
+  long offset;            /*Range being copied*/
+  long last;
+  struct pipe_slot *slots;
+  int numSlots;
+  int filled;             /*Slots the writer hasn't emptied yet*/
+  pthread_mutex_t lock;   /*Protects filled*/
+  pthread_cond_t moved;   /*Signalled whenever filled changes*/
+} *readPipe;
+
+/*Tells the kernel a run is about to be read, so it can start fetching it
+ *before the reader asks. An image that was read in needs no help.*/
+static void hintRun(tools target, extent run)
+{
+  long imgOff, len, page;
+  imgMap image;
+
+  image = target->map;
+
+  if(run->hole || (image->direct && !image->mapped))
+    return;
+
+  imgOff = target->offset + (long)run->start * target->zonesize;
+  len = (long)run->len * target->zonesize;
+  if(imgOff < 0 || imgOff >= image->size)
+    return;
+  if(len > image->size - imgOff)
+    len = image->size - imgOff;
+
+  /*Compressed images have the chunks covering it hinted instead*/
+  if(image->zimg)
+    zimgRange(image->zimg, imgOff, len, &imgOff, &len);
+
+  if(!image->mapped)
+  {
+    posix_fadvise(image->fd, imgOff, len, POSIX_FADV_WILLNEED);
+    return;
+  }
+
+  /*madvise wants the start on a page boundary*/
+  page = sysconf(_SC_PAGESIZE);
+  madvise((char *)image->data + imgOff / page * page, len + imgOff % page,
+	  MADV_WILLNEED);
+}
+
+/*Waits for the given slot to be free (reader) or filled (writer)*/
+static pipeSlot pipeWait(readPipe pipe, int slot, int writer)
+{
+  pthread_mutex_lock(&pipe->lock);
+
+  /*Both stages can't be waiting at once, so one condition does*/
+  while(writer ? pipe->filled == 0 : pipe->filled == pipe->numSlots)
+    pthread_cond_wait(&pipe->moved, &pipe->lock);
+
+  pthread_mutex_unlock(&pipe->lock);
+  return &pipe->slots[slot];
+}
+
+/*Hands the slot over to the other stage and moves on to the next one*/
+static void pipePass(readPipe pipe, int *slot, int writer)
+{
+  pthread_mutex_lock(&pipe->lock);
+  pipe->filled += writer ? -1 : 1;
+  pthread_cond_signal(&pipe->moved);
+  pthread_mutex_unlock(&pipe->lock);
+
+  *slot = (*slot + 1) % pipe->numSlots;
+}
+
+/*The reader stage: reads the range a chunk at a time into the ring,
+ *hinting each run to the kernel a run ahead of reading it*/
+static void *pipeReader(void *arg)
+{
+  long runOff, runBytes, skip, toRead, imgOff;
+  readPipe pipe;
+  tools target;
+  pipeSlot slot;
+  extent run;
+  double start;
+  int i, next;
+
+  pipe = arg;
+  target = pipe->target;
+  next = 0;
+
+  if(pipe->map->numRuns > 0)
+    hintRun(target, &pipe->map->runs[0]);
+
+  for(i = 0; i < pipe->map->numRuns; i++)
+  {
+    run = &pipe->map->runs[i];
+    start = traceStart();
+
+    if(i + 1 < pipe->map->numRuns)
+      hintRun(target, &pipe->map->runs[i + 1]);
+
+    runBytes = runInRange(target, run, pipe->offset, pipe->last, &skip);
+
+    if(run->hole)
+    {
+      slot = pipeWait(pipe, next, 0);
+      slot->hole = 1;
+      slot->end = 0;
+      slot->len = runBytes;
+      pipePass(pipe, &next, 0);
+      continue;
+    }
+
+    for(runOff = 0; runOff < runBytes; runOff += toRead)
+    {
+      toRead = runBytes - runOff;
+      if(toRead > target->maxIO)
+	toRead = target->maxIO;
+
+      imgOff = target->offset + (long)run->start * target->zonesize + skip +
+	runOff;
+
+      slot = pipeWait(pipe, next, 0);
+      slot->hole = 0;
+      slot->end = 0;
+      slot->len = toRead;
+      slot->chunk = imgRead(target->map, imgOff, toRead, slot->data, IO_DATA);
+
+      /*Touching a mapping here is what gets the disk read in this stage
+       *instead of as page faults in the writer*/
+      if(target->map->mapped)
       {
-	      /*Write to the destination*/
-	      if( fwrite(buffer, sizeof(char), target->zonesize, destination)
-	          != target->zonesize)
-        {
-	        perror("readFile - fwrite");
-	        exit(EXIT_FAILURE);
-	      }
-      }	  
+	memcpy(slot->data, slot->chunk, toRead);
+	slot->chunk = slot->data;
+      }
+
+      pipePass(pipe, &next, 0);
+    }
+
+    traceSpan(start, "read", NULL,
+	      "\"logical\":%u,\"zone\":%u,\"bytes\":%ld",
+	      run->logical, run->start, runBytes);
+  }
+
+  slot = pipeWait(pipe, next, 0);
+  slot->end = 1;
+  pipePass(pipe, &next, 0);
+
+  return NULL;
+}
+
+/*Copies the range the same way readRange does, but with a reader thread
+ *filling a ring of buffers buffers while this thread writes them out, so
+ *reading the image and writing a slow destination overlap. The kernel copy
+ *is never used, it would put both back in one system call.*/
+void readPipelined(tools target, inode file, FILE *destination, long offset,
+		   long length, int buffers)
+{
+  struct read_pipe pipe;
+  struct stat info;
+  pthread_t reader;
+  pipeSlot slot;
+  double start;
+  int i, next, isFile;
+
+  if(offset < 0 || offset >= file->size || length <= 0)
+    return;
+
+  pipe.target = target;
+  pipe.offset = offset;
+  pipe.map = rangeExtents(target, file, offset, length, &pipe.last);
+  pipe.numSlots = buffers;
+  pipe.filled = 0;
+  pthread_mutex_init(&pipe.lock, NULL);
+  pthread_cond_init(&pipe.moved, NULL);
+
+  /*An image read into memory is already as close as it gets*/
+  pipe.slots = calloc(buffers, sizeof(struct pipe_slot));
+  if(!target->map->direct || target->map->mapped)
+    for(i = 0; i < buffers; i++)
+      pipe.slots[i].data = malloc(target->maxIO);
+
+  isFile = fstat(fileno(destination), &info) == 0 && S_ISREG(info.st_mode);
+
+  if( (errno = pthread_create(&reader, NULL, pipeReader, &pipe)) != 0 )
+  {
+    perror("readPipelined - pthread_create");
+    exit(EXIT_FAILURE);
+  }
+
+  /*The writer stage*/
+  for(next = 0; !(slot = pipeWait(&pipe, next, 1))->end;
+      pipePass(&pipe, &next, 1))
+  {
+    start = traceStart();
+
+    if(slot->hole)
+      skipHole(destination, isFile, slot->len);
+    else if( fwrite(slot->chunk, sizeof(char), slot->len, destination)
+	     != slot->len )
+    {
+      perror("readFile - fwrite");
+      exit(EXIT_FAILURE);
+    }
+
+    traceSpan(start, slot->hole ? "hole" : "write", NULL,
+	      "\"bytes\":%ld", slot->len);
+  }
+
+  pthread_join(reader, NULL);
+
+  if(isFile && pipe.map->numRuns > 0 &&
+     pipe.map->runs[pipe.map->numRuns - 1].hole)
+    sizeForHole(destination);
+
+  for(i = 0; i < buffers; i++)
+    free(pipe.slots[i].data);
+  free(pipe.slots);
+  pthread_cond_destroy(&pipe.moved);
+  pthread_mutex_destroy(&pipe.lock);
+  freeExtents(pipe.map);
+}
+
+/*Writes all len bytes of buffer at offset in the destination*/
+static void pwriteAll(int destFd, char *buffer, long len, long offset)
+{
+  ssize_t written;
+
+  while(len > 0)
+  {
+    written = pwrite(destFd, buffer, len, offset);
+
+    if(written < 0 && errno == EINTR)
+      continue;
+
+    if(written < 0)
+    {
+      perror("writeFile - pwrite");
+      exit(EXIT_FAILURE);
     }
+
+    buffer += written;
+    offset += written;
+    len -= written;
   }
 }
+
+/*Like readFile, but every run is written at its own offset in destFd
+ *(which must be a regular file) instead of through a stream. Holes are
+ *skipped and the file is sized at the end, so they stay holes. Nothing is
+ *shared between calls, so many files can be written at once.*/
+void writeFile(tools target, inode file, int destFd)
+{
+  char *buffer, *scratch;
+  int i, zeroCopy;
+  long runOff, runBytes, left, toWrite, imgOff, fileOff, done;
+  loff_t outOff;
+  extMap map;
+  extent run;
+  double start;
+
+  map = getExtents(target, file, NULL);
+
+  /*Chunks get read here if the image isn't in memory*/
+  scratch = target->map->direct ? NULL : malloc(target->maxIO);
+  zeroCopy = target->zeroCopy;
+
+  for(i = 0; i < map->numRuns; i++)
+  {
+    run = &map->runs[i];
+
+    if(run->hole)
+      continue;
+
+    start = traceStart();
+
+    /*The run might go past the end of the file (partial last zone)*/
+    left = file->size - (long)run->logical * target->zonesize;
+    runBytes = (long)run->len * target->zonesize;
+    if(runBytes > left)
+      runBytes = left;
+
+    for(runOff = 0; runOff < runBytes; runOff += toWrite)
+    {
+      toWrite = runBytes - runOff;
+      if(toWrite > target->maxIO)
+	toWrite = target->maxIO;
+
+      imgOff = target->offset + (long)run->start * target->zonesize + runOff;
+      fileOff = (long)run->logical * target->zonesize + runOff;
+
+      done = 0;
+      if(zeroCopy)
+      {
+	outOff = fileOff;
+	done = kernelCopy(target->map, destFd, 1, imgOff, toWrite, &outOff,
+			  &zeroCopy);
+      }
+
+      if(done == toWrite)
+	continue;
+
+      buffer = imgRead(target->map, imgOff + done, toWrite - done, scratch,
+		       IO_DATA);
+      pwriteAll(destFd, buffer, toWrite - done, fileOff + done);
+    }
+
+    traceSpan(start, "extent", NULL,
+	      "\"logical\":%u,\"zone\":%u,\"bytes\":%ld",
+	      run->logical, run->start, runBytes);
+  }
+
+  /*Trailing holes don't get written, so set the size explicitly*/
+  if( ftruncate(destFd, file->size) < 0 )
+  {
+    perror("writeFile - ftruncate");
+    exit(EXIT_FAILURE);
+  }
+
+  free(scratch);
+  freeExtents(map);
+}
@@ -10,6 +10,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <setjmp.h>
 
 /*Ordered somewhat in terms of when they are needed*/
 
@@ -32,6 +34,27 @@
 
 #define DIRECT_ZONES 7
 
+#define MAX_IO (1 << 20) /*Default largest single copy in readFile (bytes)*/
+#define ZERO_PAGE 4096   /*Zeros written at a time for holes in streams*/
+#define PIPE_BUFS 4      /*Default buffers between readPipelined's stages*/
+#define INODE_CACHE 64   /*Default number of inode table blocks to cache*/
+#define INDEX_CAP (64L << 20) /*Default memory limit for directory indexes*/
+#define INDEX_MIN 64     /*Directories with fewer entry slots aren't indexed*/
+#define INDEX_BUCKETS 256 /*Buckets for finding a directory's index*/
+#define DENTRY_BUCKETS 4096 /*Buckets in the path lookup cache*/
+#define DENTRY_MAX 65536    /*Lookups remembered before starting over*/
+#define SCAN_CHUNK (1L << 20) /*Default inode table bytes minfind reads*/
+#define URING_DEPTH 64   /*Default submission slots in an io_uring*/
+#define URING_BUFS 16    /*Most read buffers an io_uring gets*/
+#define ZIMG_CHUNK (64 << 10) /*Default chunk size of a compressed image*/
+#define ZIMG_CACHE 64         /*Decompressed chunks kept per image*/
+#define ARENA_BLOCK (64L << 10) /*Memory an arena grabs at a time (bytes)*/
+#define ARENA_ALIGN 16          /*Alignment of everything from an arena*/
+
+/*How openImage should get at the image*/
+#define ACCESS_MAP 0   /*mmap it if possible*/
+#define ACCESS_PREAD 1 /*Always pread into caller buffers*/
+
 /*Bit masks for inode modes*/
 #define FILE_TYPE_MASK 0170000
 #define REG_TYPE 0100000
@@ -46,6 +69,41 @@
 #define O_WR 0000002
 #define O_EX 0000001
 
+/*Who is reading the image, for the I/O statistics*/
+#define IO_PART 0    /*findPart (partition tables)*/
+#define IO_SUPER 1   /*getSuper*/
+#define IO_INODE 2   /*getInode (inode table blocks)*/
+#define IO_FENT 3    /*readFEnt*/
+#define IO_ZONE 4    /*readZone (directory contents)*/
+#define IO_BLOCK 5   /*readBlock (indirect blocks)*/
+#define IO_DATA 6    /*readFile and writeFile (file contents)*/
+#define IO_BITMAP 7  /*getUsage (inode and zone bitmaps)*/
+#define IO_CALLERS 8
+
+/*How --stats prints them*/
+#define STATS_NONE 0
+#define STATS_TABLE 1
+#define STATS_JSON 2
+#define OPT_STATS 256 /*What getopt_long returns for --stats*/
+#define OPT_TRACE 257 /*And for --trace*/
+#define OPT_DAEMON 258 /*And for --daemon*/
+#define OPT_OFFSET 259 /*And for --offset*/
+#define OPT_LENGTH 260 /*And for --length*/
+#define OPT_URING 261  /*And for --uring*/
+#define OPT_PIPELINE 262 /*And for --pipeline*/
+
+/*Things minfsd can be asked for (see minsock.c)*/
+#define DAEMON_LIST 1 /*A directory's entries, or a file's inode*/
+#define DAEMON_STAT 2 /*Just the inode*/
+#define DAEMON_READ 3 /*A regular file's contents*/
+#define DAEMON_MAX_FRAME (64L << 20) /*Largest frame anyone will accept*/
+#define DAEMON_IDLE 60 /*Default seconds minfsd waits on a quiet client*/
+
+/*Orders a listing can be sorted into*/
+#define SORT_NONE 0 /*Order the entries are in the directory*/
+#define SORT_NAME 1 /*By name*/
+#define SORT_SIZE 2 /*Largest first*/
+
 /*Number of printable fields in the superblock*/
 #define numSuperFields 10
 
@@ -114,14 +172,227 @@ typedef struct __attribute__ ((__packed__)) directory_entry
   unsigned char name[60]; /*filename string*/
 } *fileEnt;
 
-/*Holds important stuff for minls to print out*/
+/*A run of zones that are next to each other both in the file and on disk*/
+typedef struct extent
+{
+  uint32_t logical; /*Index of the run's first zone within the file*/
+  uint32_t start;   /*First zone number on disk (0 for a hole)*/
+  uint32_t len;     /*Number of zones in the run*/
+  int hole;         /*1 if this run is a hole (zone number 0)*/
+} *extent;
+
+/*The layout of a file (or a range of its zones) as a list of runs*/
+typedef struct extent_map
+{
+  uint32_t first;    /*Index within the file of the first zone covered*/
+  uint32_t numZones; /*Number of zones covered by the runs*/
+  int numRuns;       /*Number of runs in the list*/
+  int maxRuns;       /*Room allocated for runs*/
+  struct extent *runs;
+  struct mem_arena *mem; /*Where this came from, NULL for malloc*/
+} *extMap;
+
+/*One chunk of memory an arena hands things out of*/
+typedef struct arena_block
+{
+  struct arena_block *next; /*Block that was filled before this one*/
+  long size;                /*Room in data (bytes)*/
+  long used;                /*How much of data has been handed out*/
+  unsigned char data[] __attribute__ ((__aligned__ (ARENA_ALIGN)));
+} *arenaBlock;
+
+/*Memory for things that are all freed at once*/
+typedef struct mem_arena
+{
+  arenaBlock blocks; /*Newest block first*/
+  long blockSize;    /*Size of each new block (bytes)*/
+  long bytes;        /*Memory held in blocks (bytes)*/
+} *arena;
+
+
+/*Holds important stuff for minls to print out. Every field of the entries
+ *is kept in its own array (entry i is at index i of each), and the names
+ *are packed one after the other in names, so sorting or filtering only has
+ *to look at the arrays it needs.*/
 typedef struct dir_listing
 {
-  fileEnt entry; /*For when we need to free it*/
-  char *perms;   /*String version of the file permissions*/
-  uint32_t size; /*in bytes*/
-  char name[60];    /*name of the file*/
-} *dirEnt;
+  int count;         /*Number of entries*/
+  uint32_t *inodes;  /*Inode number of each entry*/
+  uint16_t *modes;   /*Mode of each entry*/
+  uint32_t *sizes;   /*Size of each entry (bytes)*/
+  uint32_t *nameOff; /*Where each entry's name starts in names*/
+  char *names;       /*Every name (60 bytes max), nul-terminated*/
+} *dirList;
+
+/*Name of entry i in a listing*/
+#define LISTNAME(l,i) ((l)->names + (l)->nameOff[i])
+
+
+
+/*Walks the entries of a directory a zone at a time*/
+typedef struct dir_iter
+{
+  struct file_tools *target; /*Filesystem the directory is in*/
+  arena mem;                 /*Where this came from, NULL for malloc*/
+  extMap map;                /*Layout of the directory*/
+  int run;                   /*Run the next zone comes from*/
+  uint32_t zone;             /*Index of the next zone within that run*/
+  int slot;                  /*Entry slots looked at so far*/
+  int numSlots;              /*Entry slots in the directory*/
+  int inZone;                /*Next entry to look at in the current zone*/
+  fileEnt entries;           /*Entries of the current zone*/
+  char *buffer;              /*Zones are read into this if need be*/
+} *dirIter;
+
+/*Marks the trailer of a compressed image*/
+#define ZIMG_MAGIC 0x7a6d696e
+#define ZIMG_VERSION 1
+
+/*Last thing in a compressed image. The image is cut into chunkSize byte
+ *chunks (the last may be shorter), each compressed on its own with zlib
+ *and stored one after the other from the start of the file. indexOff
+ *points at numChunks + 1 offsets, where each chunk starts and then where
+ *the index does. A chunk that didn't get smaller is stored as it was.
+ *Everything is in host order, like the rest of the image.*/
+typedef struct __attribute__ ((__packed__)) zimg_trailer
+{
+  uint32_t magic;     /*ZIMG_MAGIC*/
+  uint32_t version;   /*ZIMG_VERSION*/
+  uint32_t chunkSize; /*Bytes of image per chunk*/
+  uint32_t numChunks;
+  uint64_t size;      /*Size of the image before compression*/
+  uint64_t indexOff;  /*Where the chunk offsets are*/
+} *zimgTrailer;
+
+/*One decompressed chunk of a compressed image*/
+typedef struct zimg_slot
+{
+  long chunk;          /*Which chunk this is, -1 if none*/
+  long lastUse;        /*When it was last read, for picking who goes*/
+  unsigned char *data; /*Contents of the chunk*/
+} *zimgSlot;
+
+/*A compressed image being read, and the chunks decompressed so far. The
+ *least recently used chunk makes way when the cache is full.*/
+typedef struct zimg_cache
+{
+  long size;            /*Size of the image before compression*/
+  uint32_t chunkSize;
+  uint32_t numChunks;
+  uint64_t *index;      /*Where each chunk starts in the file, and ends*/
+  int *slotOf;          /*For each chunk, its slot (or -1)*/
+  struct zimg_slot *slots;
+  int numSlots;
+  long clock;           /*Ticks on every lookup*/
+  long hits;            /*Lookups that found their chunk decompressed*/
+  long misses;          /*Chunks that had to be decompressed*/
+  pthread_mutex_t lock; /*Lets more than one thread read the image*/
+} *zimgCache;
+
+/*What one caller has read from the image*/
+typedef struct io_count
+{
+  long reads;  /*Reads of the image (imgRead calls and kernel copies)*/
+  long preads; /*pread calls made for them*/
+  long seeks;  /*Reads that didn't start where the last one ended*/
+  long bytes;  /*Bytes read*/
+} *ioCount;
+
+/*Describes where the image contents live. Normally this is an mmap of the
+ *whole image, streams that can't be mapped get read in, and anything else
+ *that can be seeked in is read with pread.*/
+typedef struct image_map
+{
+  unsigned char *data; /*Start of the image contents (NULL for pread)*/
+  long size;           /*Size of the image (bytes)*/
+  int mapped;          /*1 if data is mmapped*/
+  int direct;          /*1 if data holds the whole image, 0 for pread*/
+  int fd;              /*File descriptor the image came from*/
+  FILE *image;         /*Stream the image came from (owned by the caller)*/
+  long reads;          /*Reads of the image, by every caller*/
+  long preads;         /*pread calls made for them*/
+  long bytes;          /*Bytes asked for*/
+  long seeks;          /*Reads that didn't follow on from the last one*/
+  long next;           /*Where the last read ended, for counting seeks*/
+  struct io_count io[IO_CALLERS]; /*The same, split up by caller*/
+  zimgCache zimg;      /*Chunks of a compressed image, NULL for others*/
+} *imgMap;
+
+
+/*One cached block of the inode table*/
+typedef struct cache_slot
+{
+  uint32_t block;      /*Which block of the inode table this is*/
+  int used;            /*1 if this slot holds a block*/
+  int ref;             /*Set on every use, cleared by the clock hand*/
+  unsigned char *data; /*Contents of the block*/
+  unsigned char *buffer; /*Where the block is read to if need be*/
+} *cacheSlot;
+
+/*How much of a file system is in use, according to its bitmaps*/
+typedef struct fs_usage
+{
+  uint32_t inodes;     /*Inodes in the file system (superblock)*/
+  uint32_t usedInodes; /*Inodes marked in use in the inode bitmap*/
+  uint32_t zones;      /*Zones in the file system (superblock)*/
+  uint32_t dataZones;  /*Zones from firstdata on, the ones the bitmap covers*/
+  uint32_t usedZones;  /*Data zones marked in use in the zone bitmap*/
+} *fsUsage;
+
+/*A fixed number of inode table blocks, evicted with the clock algorithm*/
+typedef struct inode_cache
+{
+  int numSlots;       /*How many blocks the cache can hold*/
+  int hand;           /*Clock hand, the next slot to consider evicting*/
+  uint32_t numBlocks; /*Number of blocks in the inode table*/
+  int *slotOf;        /*For each inode table block, its slot (or -1)*/
+  struct cache_slot *slots;
+  long hits;          /*Lookups that found their block cached*/
+  long misses;        /*Lookups that had to load their block*/
+  pthread_mutex_t lock; /*Lets more than one thread look up inodes*/
+} *iCache;
+
+
+/*Hash table of the entries in one directory, keyed by name*/
+typedef struct dir_index
+{
+  int dirNum;                       /*Inode number of the directory*/
+  int size;                         /*Slots in table (a power of two)*/
+  int count;                        /*Entries in the directory*/
+  int *table;                       /*Index into entries, -1 if empty*/
+  struct directory_entry *entries;  /*Copies of the directory's entries*/
+  struct dir_index *next;           /*Next index in the same bucket*/
+} *dirIndex;
+
+/*Every directory index built so far*/
+typedef struct index_set
+{
+  dirIndex *buckets; /*Indexes, hashed by directory inode number*/
+  int numIndexes;    /*Number of directories indexed*/
+  long bytes;        /*Memory used by the indexes*/
+  long cap;          /*Most memory the indexes are allowed to use*/
+  pthread_mutex_t lock; /*Protects the buckets and byte count*/
+} *indexSet;
+
+
+/*One remembered lookup of a name in a directory*/
+typedef struct dentry
+{
+  int parent;          /*Inode number of the directory searched*/
+  int child;           /*Inode number found, 0 if the name isn't there*/
+  char name[61];       /*Name that was looked up*/
+  struct dentry *next; /*Next dentry in the same bucket*/
+} *dentry;
+
+/*Results of every path component looked up so far*/
+typedef struct dentry_cache
+{
+  dentry *buckets; /*Dentries, hashed by parent and name*/
+  int count;       /*Number of dentries*/
+  long hits;       /*Lookups answered from the cache*/
+  long misses;     /*Lookups that had to search the directory*/
+  pthread_mutex_t lock; /*Lets more than one thread resolve paths*/
+} *dentCache;
 
 
 /*This structure holds important values that we need to navigate the filesystem
@@ -132,33 +403,163 @@ typedef struct file_tools
 {
   super superblock;  /*Contents of our filesystem's superblock*/
   inode inode;       /*Contents of the target's inode*/
-  FILE *image;       /*Stream that we are reading from*/
+  int iNum;          /*Number of the target's inode*/
+  imgMap map;        /*The image we are reading from*/
+  iCache icache;     /*Recently used blocks of the inode table*/
+  indexSet indexes;  /*Name indexes of directories searched so far*/
+  dentCache dentries; /*Path components resolved so far*/
   long offset;       /*Offset in the image file of where our filesystem is*/
   int zonesize;      /*Size of the zones in this filesystem (bytes)*/
   long inodeOff;     /*Offset to beginning of inode block*/
   long zoneOff;      /*Offset to beginning of zones*/
   int filePerZone;   /*Number of fileEnts per zone*/
   int zonesPerBlock; /*Number of zones in a block (indirect/2indirect)*/
-  char *perms;       /*String version of inodes permissions*/
+  long maxIO;        /*Largest single copy readFile will do (bytes)*/
+  int zeroCopy;      /*1 if readFile may have the kernel copy the data*/
+  arena mem;         /*Holds files, freed with the tools*/
   int numFiles;      /*Number of files in a directory, 0 if regular file*/
-  dirEnt *files;     /*List of dir_listings*/
+  dirList files;     /*Contents of the directory*/
+  struct superblock superBuf; /*Where superblock is read to if need be*/
+  struct inode inodeBuf;      /*Where inode is copied to*/
 } *tools;
 
 
+/*Start of a request to minfsd, the image path and the path in the image
+ *follow it (nul-terminated)*/
+typedef struct daemon_request
+{
+  uint32_t op;     /*DAEMON_...*/
+  int32_t part;    /*Partition, -1 for none*/
+  int32_t subpart; /*Subpartition, -1 for none*/
+} *daemonReq;
+
+/*minfsd's answer, an error message follows it if status isn't 0*/
+typedef struct daemon_reply
+{
+  int32_t status;     /*0 if it worked*/
+  uint32_t iNum;      /*Inode number the path led to*/
+  struct inode inode; /*And its contents*/
+  uint32_t count;     /*Entries in the listing that follows (DAEMON_LIST)*/
+} *daemonReply;
+
+/*Each piece of a file minfsd sends for DAEMON_READ starts with one of
+ *these. len bytes of contents follow it, unless it is a hole.*/
+typedef struct daemon_run
+{
+  uint32_t hole; /*1 if the client should just skip len bytes*/
+  uint32_t len;  /*Bytes of the file in this piece*/
+} *daemonRun;
+
+
+/*What a work pool does with each task it is given*/
+typedef struct work_pool *pool;
+typedef struct uring_ring *uring;
+typedef void (*taskFn)(pool p, int worker, void *task, void *arg);
+
+
 /*Functions included*/
-char *getMode(uint16_t perms);
-int validatePart(FILE *image);
-long findPartOffset(long offset, FILE *image, int sect);
-long findPart(FILE *image, int part, int subpart);
-tools getSuper(FILE *image, int part, int subpart);
-inode getInode(tools target, int iNum);
-void readZone(tools target, char *buffer, int zoneNum);
-void readBlock(tools target, void *buffer, int zoneNum);
-void readFEnt(tools target, fileEnt buffer, int zoneNum, int fIndex);
-uint32_t getZoneNum(tools target, inode folder, int zoneNum);
-fileEnt getMatch(tools target, inode folder, int numFiles, char *string);
+
+/*minimage.c*/
+imgMap openImage(FILE *image, int access);
+void closeImage(imgMap map);
+void *imgRead(imgMap map, long offset, long len, void *scratch, int caller);
+void countRead(imgMap map, int caller, long offset, long len);
+char *ioName(int caller);
+jmp_buf *catchDamage(jmp_buf *where);
+void imgFail(void);
+
+/*minzimg.c*/
+zimgCache openZimg(int fd);
+void closeZimg(zimgCache zimg);
+void *zimgRead(imgMap map, long offset, long len, void *scratch, int caller);
+void zimgRange(zimgCache zimg, long offset, long len, long *fileOff,
+	       long *fileLen);
+
+/*minfs.c*/
+void closeTools(tools target);
+char *getMode(uint16_t perms, char *string);
+int validatePart(imgMap map, long offset);
+long findPartOffset(long offset, imgMap map, int sect);
+long findPart(imgMap map, int part, int subpart);
+tools getSuper(FILE *image, int part, int subpart, int access);
+void freeInodeCache(iCache cache);
+void setInodeCache(tools target, int blocks);
+inode getInode(tools target, int iNum, inode scratch);
+char *readZone(tools target, int zoneNum, char *scratch);
+void *readBlock(tools target, int zoneNum, void *scratch);
+fileEnt readFEnt(tools target, int zoneNum, int fIndex, fileEnt scratch);
+extMap getExtents(tools target, inode file, arena mem);
+extMap getExtentRange(tools target, inode file, arena mem, uint32_t first,
+		      uint32_t count);
+void freeExtents(extMap map);
+uint32_t getZoneNum(extMap map, uint32_t zoneNum);
+dirIter openDir(tools target, inode folder, arena mem);
+fileEnt nextEnt(dirIter iter);
+void closeDir(dirIter iter);
+uint32_t getMatch(tools target, int dirNum, char *string, arena scratch);
+int resolvePath(tools target, char **path, int depth);
 int findFolder(tools target, char **path, int depth);
+dirList readListing(tools target, inode folder, arena mem);
+void sortListing(dirList list, int order, arena mem);
 void getContents(tools target);
-void readFile(tools target, FILE *destination);
+long countBits(unsigned char *bitmap, long bits);
+unsigned char *readInodeMap(tools target, void **scratch, long *bits);
+void getUsage(tools target, fsUsage usage);
+int statsFormat(char *arg);
+void printStats(tools target, int format);
+void skipHole(FILE *destination, int isFile, long len);
+void sizeForHole(FILE *destination);
+void readFile(tools target, inode file, FILE *destination);
+void readRange(tools target, inode file, FILE *destination, long offset,
+	       long length);
+void readPipelined(tools target, inode file, FILE *destination, long offset,
+		   long length, int buffers);
+void writeFile(tools target, inode file, int destFd);
+
+/*minpool.c*/
+pool makePool(int numWorkers, taskFn fn, void *arg);
+void poolSubmit(pool p, int id, void *task);
+void finishPool(pool p);
+int defaultWorkers(void);
+
+/*minarena.c*/
+arena makeArena(long blockSize);
+void *arenaAlloc(arena mem, long len);
+void resetArena(arena mem);
+void freeArena(arena mem);
+
+/*mintrace.c*/
+int startTrace(char *file);
+void stopTrace(void);
+double traceStart(void);
+void traceSpan(double start, char *name, char *label, char *fmt, ...);
+
+/*minsock.c*/
+int sendAll(int sock, void *data, long len);
+int recvAll(int sock, void *data, long len);
+int sendFrame(int sock, void *data, uint32_t len);
+void *recvFrame(int sock, uint32_t *len, arena mem);
+int daemonListen(char *path);
+int daemonAsk(char *sockPath, int op, char *image, int part, int subpart,
+	      char *path, daemonReply reply, arena mem);
+char *daemonPath(char **path, int depth, arena mem);
+dirList recvListing(int sock, daemonReply reply, arena mem);
+int recvContents(int sock, daemonReply reply, FILE *destination);
+
+/*minuring.c*/
+uring makeUring(tools target, int depth);
+void uringCopy(uring ring, inode file, int destFd);
+void uringDrain(uring ring);
+void freeUring(uring ring);
+
+/*minindex.c*/
+void setIndexCap(tools target, long cap);
+void freeIndexes(indexSet set);
+int indexLookup(tools target, int dirNum, inode folder, char *string,
+		uint32_t *child, arena scratch);
+void clearDentries(tools target);
+void freeDentries(tools target);
+int findDentry(tools target, int parent, char *name, int *child);
+void addDentry(tools target, int parent, char *name, int child);
 
 #endif
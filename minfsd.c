@@ -0,0 +1,524 @@
+/*minfsd keeps minix images open and answers list, stat and read requests
+ *for them over a Unix domain socket, so the inode cache, dentry cache and
+ *directory indexes stay warm from one request to the next. minls and minget
+ *talk to it with --daemon. Connections are served by a pool of threads.
+ *usage:
+
+ minfsd [-v] [-j threads] [-c blocks] [-t seconds] socket
+
+ *The verbose argument prints each request to stderr
+ *Connections that send nothing (or take nothing) for seconds are closed,
+ *    so they don't hold on to a thread
+ *Images are opened the first time they are asked for and kept open until
+ *    minfsd exits, or until the file changes (a different file, size or
+ *    modify time), when it is opened again. The protocol is described in
+ *    minsock.c.
+ *A damaged image or a bad request only gets that request an error, minfsd
+ *    keeps serving everything else. Images are read with pread rather than
+ *    mapped, so one that is cut short while in use is just damaged too,
+ *    instead of a SIGBUS.
+ */
+
+#include "minfs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+/*An image (and partition) that has been opened*/
+typedef struct open_image
+{
+  char *path;              /*What the image was asked for as*/
+  int part;                /*Partition, -1 for none*/
+  int subpart;             /*Subpartition, -1 for none*/
+  FILE *file;              /*The image itself*/
+  tools target;            /*Its file system, shared by every connection*/
+  dev_t dev;               /*Which file it was when it was opened*/
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  int users;               /*Requests using it right now*/
+  int stale;               /*1 once the file has changed, freed when unused*/
+  struct open_image *next;
+} *openImg;
+
+/*Everything the workers share*/
+typedef struct daemon_job
+{
+  int listener;          /*Socket connections are accepted on*/
+  int verbose;           /*1 to print each request*/
+  long cacheBlocks;      /*Inode table blocks to cache for each image*/
+  long idle;             /*Seconds before a quiet connection is closed*/
+  openImg images;        /*Every image opened so far, and still current*/
+  pthread_mutex_t lock;  /*Protects images and their users*/
+} *daemonJob;
+
+/*A task for the pool: one connection to serve, or (fd < 0) accepting new
+ *connections, which runs for as long as minfsd does*/
+typedef struct daemon_task
+{
+  int fd;
+} *daemonTask;
+
+void usage()
+{
+  fprintf(stderr, "usage: minfsd [-v] [-j threads] [-c blocks] [-t seconds]"
+	  " socket\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "-j  threads --- threads serving connections"
+	  " (default: cpus)\n");
+  fprintf(stderr, "-c  blocks  --- inode table blocks to cache per image"
+	  " (default: %d)\n", INODE_CACHE);
+  fprintf(stderr, "-t  seconds --- close connections idle this long"
+	  " (default: %d)\n", DAEMON_IDLE);
+  fprintf(stderr, "-v  verbose --- print each request\n");
+  exit(EXIT_FAILURE);
+}
+
+/*Closes an image nobody is using any more*/
+static void freeImage(openImg img)
+{
+  closeTools(img->target);
+  fclose(img->file);
+  free(img->path);
+  free(img);
+}
+
+/*Says whether info is the same file, unchanged, as when img was opened*/
+static int sameFile(openImg img, struct stat *info)
+{
+  return img->dev == info->st_dev && img->ino == info->st_ino &&
+    img->size == info->st_size &&
+    img->mtime.tv_sec == info->st_mtim.tv_sec &&
+    img->mtime.tv_nsec == info->st_mtim.tv_nsec;
+}
+
+/*Finds the given image and partition, opening it if nobody has asked for
+ *it yet or the file has changed since. Returns NULL with *err set if it
+ *can't be opened. The image is kept until releaseImage.*/
+static openImg findImage(daemonJob job, char *path, int part, int subpart,
+			 char **err)
+{
+  struct stat info;
+  jmp_buf damaged, *outer;
+  openImg img, *link;
+  FILE *file;
+  tools target;
+  int fd;
+
+  pthread_mutex_lock(&job->lock);
+
+  if( stat(path, &info) < 0 )
+  {
+    pthread_mutex_unlock(&job->lock);
+    *err = strerror(errno);
+    return NULL;
+  }
+
+  for(link = &job->images; (img = *link); link = &img->next)
+    if(img->part == part && img->subpart == subpart &&
+       strcmp(img->path, path) == 0)
+    {
+      if( sameFile(img, &info) )
+      {
+	img->users++;
+	pthread_mutex_unlock(&job->lock);
+	return img;
+      }
+
+      /*Changed since it was opened. Nobody new gets it, and it goes once
+       *the requests still using it are done.*/
+      *link = img->next;
+      img->stale = 1;
+      if(img->users == 0)
+	freeImage(img);
+      break;
+    }
+
+  /*Opened with the lock held, so nobody opens the same image twice. Not
+   *waiting on fifos, only regular files are served.*/
+  if( (fd = open(path, O_RDONLY | O_NONBLOCK)) < 0 )
+  {
+    pthread_mutex_unlock(&job->lock);
+    *err = strerror(errno);
+    return NULL;
+  }
+
+  if( fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) ||
+      !(file = fdopen(fd, "r")) )
+  {
+    pthread_mutex_unlock(&job->lock);
+    close(fd);
+    *err = "minfsd only serves images that are regular files.";
+    return NULL;
+  }
+
+  /*Anything getSuper can't read has to let go of the lock*/
+  outer = catchDamage(&damaged);
+  if( setjmp(damaged) )
+  {
+    catchDamage(outer);
+    pthread_mutex_unlock(&job->lock);
+    fclose(file);
+    *err = "The image is damaged.";
+    return NULL;
+  }
+
+  target = getSuper(file, part, subpart, ACCESS_PREAD);
+  catchDamage(outer);
+
+  if(!target)
+  {
+    pthread_mutex_unlock(&job->lock);
+    fclose(file);
+    *err = "This doesn't look like a minix file system.";
+    return NULL;
+  }
+
+  if(job->cacheBlocks != INODE_CACHE)
+    setInodeCache(target, job->cacheBlocks);
+
+  img = malloc(sizeof(struct open_image));
+  img->path = malloc(strlen(path) + 1);
+  strcpy(img->path, path);
+  img->part = part;
+  img->subpart = subpart;
+  img->file = file;
+  img->target = target;
+  img->dev = info.st_dev;
+  img->ino = info.st_ino;
+  img->size = info.st_size;
+  img->mtime = info.st_mtim;
+  img->users = 1;
+  img->stale = 0;
+  img->next = job->images;
+  job->images = img;
+
+  pthread_mutex_unlock(&job->lock);
+  return img;
+}
+
+/*Done with an image found with findImage*/
+static void releaseImage(daemonJob job, openImg img)
+{
+  pthread_mutex_lock(&job->lock);
+  if(--img->users == 0 && img->stale)
+    freeImage(img);
+  pthread_mutex_unlock(&job->lock);
+}
+
+/*Sends a reply saying no, and why*/
+static int sendError(int sock, char *message, arena mem)
+{
+  struct daemon_reply reply;
+  char *frame;
+  long len;
+
+  memset(&reply, 0, sizeof(reply));
+  reply.status = -1;
+
+  len = sizeof(reply) + strlen(message) + 1;
+  frame = arenaAlloc(mem, len);
+  memcpy(frame, &reply, sizeof(reply));
+  strcpy(frame + sizeof(reply), message);
+
+  return sendFrame(sock, frame, len);
+}
+
+/*Sends the reply for a read and then the contents of the file, one piece
+ *per run of zones: a run's data at most maxIO bytes at a time, and just a
+ *header for a hole, so the client can keep it a hole. A file with zones
+ *past the end of the image gets an error instead. *streaming is set once the reply is out, after
+ *which the only way to say something went wrong is to hang up. Returns -1
+ *if the client went away.*/
+static int sendContents(int sock, tools target, daemonReply reply,
+			arena mem, volatile int *streaming)
+{
+  struct daemon_run piece;
+  char *buffer, *scratch;
+  long runOff, runBytes, left, toSend, imgOff;
+  int i, err;
+  inode file;
+  extMap map;
+  extent run;
+
+  /*Everything comes out of the arena, so it goes with the request even if
+   *the image fails part way*/
+  file = &reply->inode;
+  map = getExtents(target, file, mem);
+
+  for(i = 0; i < map->numRuns; i++)
+  {
+    run = &map->runs[i];
+    if(!run->hole && target->offset + ((long)run->start + run->len) *
+       target->zonesize > target->map->size)
+      return sendError(sock, "The file runs past the end of the image.", mem);
+  }
+
+  *streaming = 1;
+  if( sendFrame(sock, reply, sizeof(struct daemon_reply)) < 0 )
+    return -1;
+
+  scratch = target->map->direct ? NULL : arenaAlloc(mem, target->maxIO);
+  err = 0;
+
+  for(i = 0; !err && i < map->numRuns; i++)
+  {
+    run = &map->runs[i];
+
+    /*The run might go past the end of the file (partial last zone)*/
+    left = file->size - (long)run->logical * target->zonesize;
+    runBytes = (long)run->len * target->zonesize;
+    if(runBytes > left)
+      runBytes = left;
+
+    piece.hole = run->hole;
+    piece.len = runBytes;
+    if( (err = sendAll(sock, &piece, sizeof(piece))) || run->hole )
+      continue;
+
+    for(runOff = 0; !err && runOff < runBytes; runOff += toSend)
+    {
+      toSend = runBytes - runOff;
+      if(toSend > target->maxIO)
+	toSend = target->maxIO;
+
+      imgOff = target->offset + (long)run->start * target->zonesize + runOff;
+      buffer = imgRead(target->map, imgOff, toSend, scratch, IO_DATA);
+      err = sendAll(sock, buffer, toSend);
+    }
+  }
+
+  return err;
+}
+
+/*Answers one request. The image it used is left in *held for the caller
+ *to release. Returns -1 if the connection should be dropped.*/
+static int answer(daemonJob job, int sock, char *frame, uint32_t len,
+		  arena mem, volatile int *streaming, openImg volatile *held)
+{
+  struct daemon_request request;
+  struct daemon_reply reply;
+  char *image, *path, **parts, *part, *save, *err;
+  int depth, iNum;
+  openImg img;
+  dirList list;
+
+  /*The request has to be followed by two strings*/
+  if(len < sizeof(request) + 2 || frame[len - 1] != '\0')
+    return -1;
+
+  memcpy(&request, frame, sizeof(request));
+  image = frame + sizeof(request);
+  path = image + strlen(image) + 1;
+  if(path >= frame + len)
+    return -1;
+
+  if(job->verbose)
+    fprintf(stderr, "minfsd: op %u on %s (%d, %d) %s\n", request.op, image,
+	    request.part, request.subpart, path);
+
+  if( !(img = findImage(job, image, request.part, request.subpart, &err)) )
+    return sendError(sock, err, mem);
+  *held = img;
+
+  /*Split the path up the same way minls and minget do*/
+  parts = arenaAlloc(mem, sizeof(char *) * (strlen(path) / 2 + 1));
+  depth = 0;
+  for(part = strtok_r(path, "/", &save); part;
+      part = strtok_r(NULL, "/", &save))
+    parts[depth++] = part;
+
+  if( (iNum = resolvePath(img->target, parts, depth)) < 0 )
+    return sendError(sock, "The provided path does not seem correct.", mem);
+
+  memset(&reply, 0, sizeof(reply));
+  reply.iNum = iNum;
+  getInode(img->target, iNum, &reply.inode);
+
+  switch(request.op)
+  {
+    case DAEMON_STAT:
+      return sendFrame(sock, &reply, sizeof(reply));
+
+    case DAEMON_LIST:
+      if(!ISDIR(reply.inode.mode))
+	return sendFrame(sock, &reply, sizeof(reply));
+
+      list = readListing(img->target, &reply.inode, mem);
+      reply.count = list->count;
+
+      /*One frame per column*/
+      if( sendFrame(sock, &reply, sizeof(reply)) < 0 ||
+	  sendFrame(sock, list->inodes, sizeof(uint32_t) * list->count) < 0 ||
+	  sendFrame(sock, list->modes, sizeof(uint16_t) * list->count) < 0 ||
+	  sendFrame(sock, list->sizes, sizeof(uint32_t) * list->count) < 0 ||
+	  sendFrame(sock, list->nameOff, sizeof(uint32_t) * list->count) < 0)
+	return -1;
+
+      /*Names run up to the end of the last one*/
+      return sendFrame(sock, list->names, list->count == 0 ? 0 :
+		       list->nameOff[list->count - 1] +
+		       strlen(LISTNAME(list, list->count - 1)) + 1);
+
+    case DAEMON_READ:
+      if(!ISREG(reply.inode.mode))
+	return sendError(sock, "minget copies regular files only.", mem);
+
+      return sendContents(sock, img->target, &reply, mem, streaming);
+
+    default:
+      return sendError(sock, "minfsd doesn't know that request.", mem);
+  }
+}
+
+/*Serves one connection until the client hangs up. Damage found in an
+ *image while answering comes back here and gets the client an error, or
+ *hung up on if the file was already on its way.*/
+static void serve(daemonJob job, int sock)
+{
+  jmp_buf damaged;
+  volatile int streaming, drop;
+  openImg volatile held;
+  char *frame;
+  uint32_t len;
+  arena mem;
+
+  mem = makeArena(ARENA_BLOCK);
+  catchDamage(&damaged);
+
+  /*recvFrame gives up once the timeout passes*/
+  while( (frame = recvFrame(sock, &len, mem)) )
+  {
+    streaming = 0;
+    held = NULL;
+
+    if( setjmp(damaged) )
+      drop = streaming || sendError(sock, "The image is damaged.", mem) < 0;
+    else
+      drop = answer(job, sock, frame, len, mem, &streaming, &held) < 0;
+
+    if(held)
+      releaseImage(job, held);
+    if(drop)
+      break;
+
+    resetArena(mem);
+  }
+
+  catchDamage(NULL);
+  freeArena(mem);
+  close(sock);
+}
+
+/*What each worker does with a task: serve a connection, or (for the one
+ *task that does it) accept connections and hand them out*/
+static void daemonTaskFn(pool p, int worker, void *task, void *arg)
+{
+  struct timeval idle;
+  daemonJob job;
+  daemonTask conn;
+  int sock;
+
+  job = arg;
+
+  if( ((daemonTask)task)->fd >= 0 )
+  {
+    serve(job, ((daemonTask)task)->fd);
+    free(task);
+    return;
+  }
+
+  /*This task never finishes, which also keeps the pool from thinking it
+   *has run out of work*/
+  while(1)
+  {
+    if( (sock = accept(job->listener, NULL, NULL)) < 0 )
+    {
+      if(errno == EINTR || errno == ECONNABORTED)
+	continue;
+
+      /*Out of descriptors, wait for some connections to finish*/
+      if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+	 errno == ENOMEM)
+      {
+	perror("minfsd - accept");
+	sleep(1);
+	continue;
+      }
+
+      perror("minfsd - accept");
+      exit(EXIT_FAILURE);
+    }
+
+    /*A client that goes quiet, either sending or reading, gets hung up on
+     *instead of keeping a thread forever*/
+    idle.tv_sec = job->idle;
+    idle.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+
+    conn = malloc(sizeof(struct daemon_task));
+    conn->fd = sock;
+    poolSubmit(p, worker, conn);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  struct daemon_job job;
+  struct daemon_task acceptor;
+  long threads;
+  pool p;
+  int i;
+
+  job.verbose = 0;
+  job.cacheBlocks = INODE_CACHE;
+  job.idle = DAEMON_IDLE;
+  job.images = NULL;
+  pthread_mutex_init(&job.lock, NULL);
+  threads = defaultWorkers();
+
+  while((i = getopt(argc, argv, "vj:c:t:")) != -1)
+    switch(i)
+    {
+      case 'v':
+	      job.verbose = 1;
+	      break;
+      case 'j':
+	      threads = strtol(optarg, NULL, 10);
+	      if(threads <= 0)
+	        usage();
+	      break;
+      case 'c':
+	      job.cacheBlocks = strtol(optarg, NULL, 10);
+	      if(job.cacheBlocks <= 0)
+	        usage();
+	      break;
+      case 't':
+	      job.idle = strtol(optarg, NULL, 10);
+	      if(job.idle <= 0)
+	        usage();
+	      break;
+      default:
+	      usage();
+	      break;
+    }
+
+  if(optind != argc - 1)
+    usage();
+
+  if( (job.listener = daemonListen(argv[optind])) < 0 )
+    exit(EXIT_FAILURE);
+
+  /*One more worker than asked for, the acceptor takes one up for good*/
+  p = makePool(threads + 1, daemonTaskFn, &job);
+  acceptor.fd = -1;
+  poolSubmit(p, -1, &acceptor);
+
+  /*Never returns, minfsd runs until it is killed*/
+  finishPool(p);
+
+  return 0;
+}
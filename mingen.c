@@ -0,0 +1,681 @@
+/*mingen is a unix program that builds a synthetic minix file system image,
+ *for testing minls/minget against file systems bigger and stranger than the
+ *example images.
+ *usage:
+
+ mingen [-v] [-b blocksize] [-z log_zone_size] [-p part [-s subpart]]
+        [-f fanout] [-d depth] [-n files] [-S min:max] [-H holes]
+        [-F frag] [-r seed] imagefile
+
+ *Every directory down to the given depth gets fanout subdirectories
+ *    (d000, d001, ...) and n files (f00000, f00001, ...)
+ *File sizes are spread evenly over powers of two between min and max bytes,
+ *    so a big max gets some indirect and double indirect files
+ *holes is the percent of file zones left out, frag is the percent of zones
+ *    put somewhere random instead of right after the last one
+ *The same arguments (and seed) always give the same image. Byte o of the
+ *    file with inode i holds byte o%8 of the 64-bit number i<<32 | o/8, so
+ *    anything read back can be checked.
+ */
+
+#include "minfs.h"
+#include <fcntl.h>
+
+/*Every timestamp in a generated image*/
+#define GEN_TIME 1500000000
+
+/*First sector of a generated partition, and of a subpartition in it*/
+#define PART_START 2048
+#define SUBPART_START 4096
+
+/*Everything needed while building the image*/
+typedef struct gen_state
+{
+  int fd;                /*Image being written*/
+  long offset;           /*Where the file system starts in the image*/
+  struct superblock sb;  /*Superblock of the file system*/
+  int zonesize;          /*Size of a zone (bytes)*/
+  uint32_t perBlock;     /*Zone numbers in an indirect block*/
+  uint32_t numBits;      /*Bits in use in the zone bitmap*/
+  unsigned char *imap;   /*Inode bitmap*/
+  unsigned char *zmap;   /*Zone bitmap*/
+  struct inode *inodes;  /*Inode table (inode 1 is at index 0)*/
+  uint32_t nextInode;    /*Next inode number to hand out*/
+  uint32_t cursor;       /*Zone bitmap bit to look at next*/
+  uint32_t usedZones;    /*Data zones handed out so far*/
+  int fanout;            /*Subdirectories per directory*/
+  int depth;             /*Levels of subdirectories*/
+  int files;             /*Files per directory*/
+  uint32_t *sizes;       /*Size of every file, in the order they're made*/
+  uint32_t nextSize;     /*Next size to use*/
+  int holes;             /*Percent of file zones left as holes*/
+  int frag;              /*Percent of zones put somewhere random*/
+  uint64_t seed;         /*State of the random number generator*/
+  unsigned char *buffer; /*One zone of data being written*/
+  long dirs;             /*Directories made*/
+  long dataBytes;        /*File bytes written*/
+} *genState;
+
+/*Keeps track of the indirect blocks of the file being written*/
+typedef struct zone_writer
+{
+  struct inode *node; /*Inode of the file*/
+  uint32_t *ind;      /*Indirect block being filled in*/
+  uint32_t indZone;   /*Zone it goes in, 0 if there isn't one yet*/
+  long slot;          /*Which indirect block it is (-1 for the single one)*/
+  uint32_t *dbl;      /*The two_indirect block*/
+} *zoneWriter;
+
+void usage()
+{
+  fprintf(stderr, "usage: mingen [-v] [-b blocksize] [-z log_zone_size]"
+	  " [-p part [-s subpart]]\n"
+	  "              [-f fanout] [-d depth] [-n files] [-S min:max]"
+	  " [-H holes]\n"
+	  "              [-F frag] [-r seed] imagefile\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "-b  bytes   --- block size (default: 4096)\n");
+  fprintf(stderr, "-z  log     --- log2 of blocks per zone (default: 0)\n");
+  fprintf(stderr, "-p  part    --- put the file system in this partition"
+	  " (default: none)\n");
+  fprintf(stderr, "-s  sub     --- and in this subpartition of it"
+	  " (default: none)\n");
+  fprintf(stderr, "-f  fanout  --- subdirectories per directory"
+	  " (default: 4)\n");
+  fprintf(stderr, "-d  depth   --- levels of subdirectories (default: 2)\n");
+  fprintf(stderr, "-n  files   --- files per directory (default: 8)\n");
+  fprintf(stderr, "-S  min:max --- range of file sizes in bytes"
+	  " (default: 0:1048576)\n");
+  fprintf(stderr, "-H  percent --- file zones left as holes (default: 0)\n");
+  fprintf(stderr, "-F  percent --- zones placed at random (default: 0)\n");
+  fprintf(stderr, "-r  seed    --- random seed (default: 1)\n");
+  fprintf(stderr, "-v  verbose --- print what was made\n");
+  exit(EXIT_FAILURE);
+}
+
+/*xorshift64*, so the same seed makes the same image everywhere*/
+static uint64_t nextRand(genState gen)
+{
+  gen->seed ^= gen->seed >> 12;
+  gen->seed ^= gen->seed << 25;
+  gen->seed ^= gen->seed >> 27;
+  return gen->seed * 2685821657736338717ULL;
+}
+
+/*True percent out of 100 times*/
+static int chance(genState gen, int percent)
+{
+  return percent > 0 && nextRand(gen) % 100 < (uint64_t)percent;
+}
+
+/*Picks a file size: first a power of two between min and max, then a size
+ *in it, so small and big files are both common*/
+static uint32_t pickSize(genState gen, uint32_t min, uint32_t max)
+{
+  int lowBits, highBits, bits;
+  uint64_t low, high;
+
+  if(min >= max)
+    return min;
+
+  for(lowBits = 0; lowBits < 32 && (min >> lowBits); lowBits++)
+    ;
+  for(highBits = 0; highBits < 32 && (max >> highBits); highBits++)
+    ;
+
+  bits = lowBits + nextRand(gen) % (highBits - lowBits + 1);
+
+  /*Sizes that need exactly that many bits, trimmed to [min, max]*/
+  low = bits ? (uint64_t)1 << (bits - 1) : 0;
+  high = ((uint64_t)1 << bits) - 1;
+  if(low < min)
+    low = min;
+  if(high > max)
+    high = max;
+
+  return low + nextRand(gen) % (high - low + 1);
+}
+
+/*Zones (data and indirect) it takes to hold a file of the given size with
+ *no holes*/
+static uint64_t zonesFor(genState gen, uint64_t size)
+{
+  uint64_t zones, total;
+
+  zones = (size + gen->zonesize - 1) / gen->zonesize;
+  total = zones;
+
+  if(zones > DIRECT_ZONES)
+    total++;
+  if(zones > DIRECT_ZONES + gen->perBlock)
+    total += 1 + (zones - DIRECT_ZONES - gen->perBlock + gen->perBlock - 1) /
+      gen->perBlock;
+
+  return total;
+}
+
+/*Writes all len bytes of buffer at offset in the image*/
+static void pwriteAll(int fd, void *buffer, long len, long offset)
+{
+  ssize_t written;
+
+  while(len > 0)
+  {
+    if( (written = pwrite(fd, buffer, len, offset)) < 0 )
+    {
+      perror("mingen - pwrite");
+      exit(EXIT_FAILURE);
+    }
+
+    buffer = (char *)buffer + written;
+    offset += written;
+    len -= written;
+  }
+}
+
+/*Hands out a free zone, usually the one after the last, sometimes (frag
+ *percent of the time) one somewhere random*/
+static uint32_t allocZone(genState gen)
+{
+  uint32_t bit;
+
+  if(gen->usedZones == gen->numBits - 1)
+  {
+    fprintf(stderr, "mingen - ran out of zones\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if(chance(gen, gen->frag))
+    gen->cursor = 1 + nextRand(gen) % (gen->numBits - 1);
+
+  /*Bit 0 is reserved, bit b is zone firstdata + b - 1*/
+  for(bit = gen->cursor; gen->zmap[bit / 8] & (1 << (bit % 8)); )
+    if(++bit == gen->numBits)
+      bit = 1;
+
+  gen->zmap[bit / 8] |= 1 << (bit % 8);
+  gen->cursor = bit + 1 == gen->numBits ? 1 : bit + 1;
+  gen->usedZones++;
+
+  return gen->sb.firstdata + bit - 1;
+}
+
+/*Hands out the next inode*/
+static uint32_t allocInode(genState gen, uint16_t mode)
+{
+  uint32_t iNum;
+  struct inode *node;
+
+  iNum = gen->nextInode++;
+  gen->imap[iNum / 8] |= 1 << (iNum % 8);
+
+  node = &gen->inodes[iNum - 1];
+  node->mode = mode;
+  node->links = 1;
+  node->atime = GEN_TIME;
+  node->mtime = GEN_TIME;
+  node->ctime = GEN_TIME;
+
+  return iNum;
+}
+
+/*Writes out the indirect block being filled in, if there is one*/
+static void flushIndirect(genState gen, zoneWriter writer)
+{
+  if(writer->indZone)
+    pwriteAll(gen->fd, writer->ind, gen->sb.blocksize,
+	      gen->offset + (long)writer->indZone * gen->zonesize);
+}
+
+/*Records that zone index k of the file is in zone z, making indirect
+ *blocks as they're needed. Indirect blocks whose zones are all holes are
+ *never made.*/
+static void setZone(genState gen, zoneWriter writer, uint64_t k, uint32_t z)
+{
+  long slot;
+
+  if(k < DIRECT_ZONES)
+  {
+    writer->node->zone[k] = z;
+    return;
+  }
+
+  k -= DIRECT_ZONES;
+  slot = k < gen->perBlock ? -1 : (long)((k - gen->perBlock) / gen->perBlock);
+
+  /*Moving on to a new indirect block*/
+  if(!writer->indZone || slot != writer->slot)
+  {
+    flushIndirect(gen, writer);
+
+    if(slot >= 0 && !writer->node->two_indirect)
+      writer->node->two_indirect = allocZone(gen);
+
+    writer->indZone = allocZone(gen);
+    writer->slot = slot;
+    memset(writer->ind, 0, gen->sb.blocksize);
+
+    if(slot < 0)
+      writer->node->indirect = writer->indZone;
+    else
+      writer->dbl[slot] = writer->indZone;
+  }
+
+  writer->ind[slot < 0 ? k : (k - gen->perBlock) % gen->perBlock] = z;
+}
+
+/*Fills the zone buffer with the pattern for the file's bytes starting at
+ *offset*/
+static void fillPattern(genState gen, uint32_t iNum, uint64_t offset,
+			long len)
+{
+  uint64_t word;
+  long i;
+  int b;
+
+  /*offset is always at the start of a zone, so words line up with i. Like
+   *the rest of minfs, this takes the host to be little-endian.*/
+  word = ((uint64_t)iNum << 32) | (offset / 8);
+  for(i = 0; i + 8 <= len; i += 8, word++)
+    memcpy(gen->buffer + i, &word, 8);
+
+  /*The last few bytes of a file might not make a whole word*/
+  for(b = 0; i + b < len; b++)
+    gen->buffer[i + b] = word >> (8 * b);
+}
+
+/*Writes the data of a file whose inode has its size filled in. Directories
+ *pass their contents, files get the pattern (and maybe some holes).*/
+static void writeData(genState gen, uint32_t iNum, unsigned char *contents)
+{
+  struct zone_writer writer;
+  uint64_t zones, k;
+  long len;
+  uint32_t z;
+
+  writer.node = &gen->inodes[iNum - 1];
+  writer.ind = malloc(gen->sb.blocksize);
+  writer.dbl = calloc(gen->perBlock, sizeof(uint32_t));
+  writer.indZone = 0;
+  writer.slot = -1;
+
+  zones = ((uint64_t)writer.node->size + gen->zonesize - 1) / gen->zonesize;
+
+  for(k = 0; k < zones; k++)
+  {
+    /*A hole is just a zone number of 0*/
+    if(!contents && chance(gen, gen->holes))
+      continue;
+
+    z = allocZone(gen);
+
+    len = writer.node->size - k * gen->zonesize;
+    if(len > gen->zonesize)
+      len = gen->zonesize;
+
+    if(contents)
+      memcpy(gen->buffer, contents + k * gen->zonesize, len);
+    else
+    {
+      fillPattern(gen, iNum, k * gen->zonesize, len);
+      gen->dataBytes += len;
+    }
+
+    pwriteAll(gen->fd, gen->buffer, len,
+	      gen->offset + (long)z * gen->zonesize);
+    setZone(gen, &writer, k, z);
+  }
+
+  flushIndirect(gen, &writer);
+  if(writer.node->two_indirect)
+    pwriteAll(gen->fd, writer.dbl, gen->sb.blocksize,
+	      gen->offset + (long)writer.node->two_indirect * gen->zonesize);
+
+  free(writer.ind);
+  free(writer.dbl);
+}
+
+/*Fills in a directory entry*/
+static void setEntry(struct directory_entry *entry, uint32_t iNum,
+		     char *name)
+{
+  entry->inode = iNum;
+  memset(entry->name, 0, sizeof(entry->name));
+  strncpy((char *)entry->name, name, sizeof(entry->name));
+}
+
+/*Makes a directory, its files and (below depth) its subdirectories.
+ *Returns its inode number.*/
+static uint32_t makeDir(genState gen, uint32_t parent, int level)
+{
+  struct directory_entry *entries;
+  struct inode *node;
+  uint32_t iNum, child;
+  int count, subdirs, i;
+  char name[61];
+
+  iNum = allocInode(gen, DIR_TYPE | 0755);
+  gen->dirs++;
+
+  /*The root is its own parent*/
+  if(!parent)
+    parent = iNum;
+
+  subdirs = level < gen->depth ? gen->fanout : 0;
+  count = 2 + subdirs + gen->files;
+  entries = calloc(count, sizeof(struct directory_entry));
+
+  setEntry(&entries[0], iNum, ".");
+  setEntry(&entries[1], parent, "..");
+
+  for(i = 0; i < gen->files; i++)
+  {
+    child = allocInode(gen, REG_TYPE | 0644);
+    gen->inodes[child - 1].size = gen->sizes[gen->nextSize++];
+    writeData(gen, child, NULL);
+
+    sprintf(name, "f%05d", i);
+    setEntry(&entries[2 + i], child, name);
+  }
+
+  for(i = 0; i < subdirs; i++)
+  {
+    child = makeDir(gen, iNum, level + 1);
+
+    sprintf(name, "d%03d", i);
+    setEntry(&entries[2 + gen->files + i], child, name);
+  }
+
+  /*. and the parent's entry, plus each subdirectory's ..*/
+  node = &gen->inodes[iNum - 1];
+  node->links = 2 + subdirs;
+  node->size = count * sizeof(struct directory_entry);
+  writeData(gen, iNum, (unsigned char *)entries);
+
+  free(entries);
+  return iNum;
+}
+
+/*Points entry sect of the partition table at table (bytes into the image)
+ *at the given sectors*/
+static void writePartTable(int fd, long table, int sect, uint32_t first,
+			   uint32_t sectors)
+{
+  struct partition_entry entry;
+  unsigned char sig[2] = {PARTITION_VALID_1, PARTITION_VALID_2};
+
+  memset(&entry, 0, sizeof(entry));
+  entry.type = PARTITION_TYPE;
+  entry.lFirst = first;
+  entry.size = sectors;
+
+  pwriteAll(fd, &entry, sizeof(entry),
+	    table + TABLE_START + sect * sizeof(struct partition_entry));
+  pwriteAll(fd, sig, 2, table + 510);
+}
+
+/*Works out where everything goes for the planned files and directories*/
+static void layOut(genState gen, int blocksize, int logZone, uint64_t dirs,
+		   uint64_t dataZones)
+{
+  uint64_t ninodes, inodeBlocks, iBlocks, zBlocks, newZBlocks, first;
+  uint64_t bitsPerBlock;
+
+  gen->zonesize = blocksize << logZone;
+  bitsPerBlock = (uint64_t)blocksize * 8;
+
+  /*Fill the last block of the inode table*/
+  ninodes = dirs * (1 + gen->files);
+  inodeBlocks = (ninodes * INODE_SIZE + blocksize - 1) / blocksize;
+  ninodes = inodeBlocks * blocksize / INODE_SIZE;
+  iBlocks = (ninodes + 1 + bitsPerBlock - 1) / bitsPerBlock;
+
+  /*The zone bitmap's size depends on where the data starts, which depends
+   *on the zone bitmap's size, so go until it settles*/
+  zBlocks = 1;
+  while(1)
+  {
+    first = ((2 + iBlocks + zBlocks + inodeBlocks) * blocksize +
+	     gen->zonesize - 1) / gen->zonesize;
+    newZBlocks = (dataZones + 1 + bitsPerBlock - 1) / bitsPerBlock;
+    if(newZBlocks == zBlocks)
+      break;
+    zBlocks = newZBlocks;
+  }
+
+  if(ninodes > UINT32_MAX || first > UINT16_MAX || iBlocks > INT16_MAX ||
+     zBlocks > INT16_MAX || first + dataZones > UINT32_MAX)
+  {
+    fprintf(stderr, "mingen - that's too big for a minix file system\n");
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&gen->sb, 0, sizeof(gen->sb));
+  gen->sb.ninodes = ninodes;
+  gen->sb.i_blocks = iBlocks;
+  gen->sb.z_blocks = zBlocks;
+  gen->sb.firstdata = first;
+  gen->sb.log_zone_size = logZone;
+  gen->sb.max_file = 0x7FFFFFFF;
+  gen->sb.zones = first + dataZones;
+  gen->sb.magic = MAGIC;
+  gen->sb.blocksize = blocksize;
+
+  gen->numBits = dataZones + 1;
+  gen->imap = calloc(iBlocks, blocksize);
+  gen->zmap = calloc(zBlocks, blocksize);
+  gen->inodes = calloc(ninodes, sizeof(struct inode));
+
+  /*Bit 0 of both maps is reserved*/
+  gen->imap[0] = 1;
+  gen->zmap[0] = 1;
+}
+
+int main(int argc, char *argv[])
+{
+  struct gen_state gen;
+  int i, verbose, blocksize, logZone, partition, subpart;
+  long int value;
+  uint64_t dirs, level, dataZones, maxZones;
+  uint32_t minSize, maxSize;
+  char *imageFile, *end;
+  long imageSize;
+
+  memset(&gen, 0, sizeof(gen));
+  verbose = 0;
+  blocksize = 4096;
+  logZone = 0;
+  partition = -1;
+  subpart = -1;
+  gen.fanout = 4;
+  gen.depth = 2;
+  gen.files = 8;
+  gen.seed = 1;
+  minSize = 0;
+  maxSize = 1 << 20;
+
+  /*--- ARG PARSING ---*/
+  while((i = getopt(argc, argv, "vb:z:p:s:f:d:n:S:H:F:r:")) != -1)
+  {
+    value = optarg ? strtol(optarg, &end, 10) : 0;
+
+    switch(i)
+    {
+      case 'v':
+	      verbose = 1;
+	      break;
+      case 'b':
+	      blocksize = value;
+	      /*A power of two that fits in the superblock*/
+	      if(blocksize < 1024 || blocksize > 32768 ||
+		 (blocksize & (blocksize - 1)))
+	        usage();
+	      break;
+      case 'z':
+	      logZone = value;
+	      if(logZone < 0 || logZone > 6)
+	        usage();
+	      break;
+      case 'p':
+	      partition = value;
+	      if(partition < 0 || partition > 3)
+	        usage();
+	      break;
+      case 's':
+	      subpart = value;
+	      if(subpart < 0 || subpart > 3)
+	        usage();
+	      break;
+      case 'f':
+	      gen.fanout = value;
+	      if(gen.fanout < 0)
+	        usage();
+	      break;
+      case 'd':
+	      gen.depth = value;
+	      if(gen.depth < 0)
+	        usage();
+	      break;
+      case 'n':
+	      gen.files = value;
+	      if(gen.files < 0)
+	        usage();
+	      break;
+      case 'S':
+	      minSize = value;
+	      if(*end != ':' || value < 0)
+	        usage();
+	      value = strtol(end + 1, NULL, 10);
+	      maxSize = value;
+	      if(value < minSize || value > UINT32_MAX)
+	        usage();
+	      break;
+      case 'H':
+	      gen.holes = value;
+	      if(gen.holes < 0 || gen.holes > 100)
+	        usage();
+	      break;
+      case 'F':
+	      gen.frag = value;
+	      if(gen.frag < 0 || gen.frag > 100)
+	        usage();
+	      break;
+      case 'r':
+	      /*xorshift gets stuck on 0*/
+	      gen.seed = value ? value : 1;
+	      break;
+      default:
+	      usage();
+	      break;
+    }
+  }
+
+  if(optind != argc - 1 || (subpart >= 0 && partition < 0))
+    usage();
+
+  imageFile = argv[optind];
+  /*--- END PARSING ARGS ---*/
+
+  gen.zonesize = blocksize << logZone;
+  gen.perBlock = blocksize / ZONE_LEN;
+
+  /*Nothing bigger than direct, indirect and double indirect zones cover*/
+  maxZones = DIRECT_ZONES + gen.perBlock +
+    (uint64_t)gen.perBlock * gen.perBlock;
+  if((uint64_t)maxSize > maxZones * gen.zonesize)
+    maxSize = maxZones * gen.zonesize;
+  if(minSize > maxSize)
+    minSize = maxSize;
+
+  /*Count the directories, 1 + fanout + fanout^2 + ...*/
+  dirs = 0;
+  for(i = 0, level = 1; i <= gen.depth; i++, level *= gen.fanout)
+    dirs += level;
+
+  /*Pick every file's size up front, so the file system can be sized*/
+  gen.sizes = malloc(sizeof(uint32_t) * dirs * gen.files + 1);
+  dataZones = 0;
+  for(level = 0; level < dirs * gen.files; level++)
+  {
+    gen.sizes[level] = pickSize(&gen, minSize, maxSize);
+    dataZones += zonesFor(&gen, gen.sizes[level]);
+  }
+
+  /*Plus the directories themselves*/
+  dataZones += zonesFor(&gen, (uint64_t)(2 + gen.fanout + gen.files) *
+			DIR_SIZE) * dirs;
+
+  /*Room to scatter zones around*/
+  if(gen.frag)
+    dataZones += dataZones / 4;
+  dataZones += 16;
+
+  layOut(&gen, blocksize, logZone, dirs, dataZones);
+
+  /*Where the file system goes*/
+  gen.offset = 0;
+  if(partition >= 0)
+    gen.offset = (long)(subpart >= 0 ? SUBPART_START : PART_START) *
+      SECTOR_SIZE;
+  imageSize = gen.offset + (long)gen.sb.zones * gen.zonesize;
+
+  if( (gen.fd = open(imageFile, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 )
+  {
+    perror(imageFile);
+    exit(EXIT_FAILURE);
+  }
+
+  /*Anything never written reads back as zeros*/
+  if( ftruncate(gen.fd, imageSize) < 0 )
+  {
+    perror("mingen - ftruncate");
+    exit(EXIT_FAILURE);
+  }
+
+  if(partition >= 0)
+    writePartTable(gen.fd, 0, partition, PART_START,
+		   imageSize / SECTOR_SIZE - PART_START);
+  if(subpart >= 0)
+    writePartTable(gen.fd, (long)PART_START * SECTOR_SIZE, subpart,
+		   SUBPART_START, imageSize / SECTOR_SIZE - SUBPART_START);
+
+  /*Build the tree, the root is inode 1*/
+  gen.buffer = malloc(gen.zonesize);
+  gen.nextInode = 1;
+  gen.cursor = 1;
+  makeDir(&gen, 0, 0);
+
+  /*Then the tables describing it*/
+  pwriteAll(gen.fd, gen.imap, (long)gen.sb.i_blocks * blocksize,
+	    gen.offset + 2L * blocksize);
+  pwriteAll(gen.fd, gen.zmap, (long)gen.sb.z_blocks * blocksize,
+	    gen.offset + (2L + gen.sb.i_blocks) * blocksize);
+  pwriteAll(gen.fd, gen.inodes, (long)gen.sb.ninodes * INODE_SIZE,
+	    gen.offset + (2L + gen.sb.i_blocks + gen.sb.z_blocks) * blocksize);
+  pwriteAll(gen.fd, &gen.sb, sizeof(gen.sb), gen.offset + SUPER_START);
+
+  if( close(gen.fd) < 0 )
+  {
+    perror(imageFile);
+    exit(EXIT_FAILURE);
+  }
+
+  if(verbose)
+  {
+    printf("%s: %ld bytes\n", imageFile, imageSize);
+    printf("  %-12s %12ld\n", "directories", gen.dirs);
+    printf("  %-12s %12ld\n", "files", gen.dirs * gen.files);
+    printf("  %-12s %12ld\n", "file bytes", gen.dataBytes);
+    printf("  %-12s %12u\n", "inodes", gen.sb.ninodes);
+    printf("  %-12s %12u of %u\n", "zones used", gen.usedZones,
+	   gen.numBits - 1);
+  }
+
+  free(gen.sizes);
+  free(gen.buffer);
+  free(gen.imap);
+  free(gen.zmap);
+  free(gen.inodes);
+
+  return 0;
+}
@@ -1,13 +1,39 @@
 /*minget is another unix program designed to read and copy out files from a 
  *minix file system. 
 
- minget [-v] [-p part [-s subpart]] imagefile srcpath [dstpath]
-  
+ minget [-v] [-b bytes] [-c blocks] [-p part [-s subpart]] imagefile srcpath [dstpath]
+ minget -r [-j threads] [...] imagefile srcdir dstdir
+ minget [--stats[=table|json]] [--trace file] [...] imagefile srcpath [dstpath]
+ minget --daemon socket [-p part [-s subpart]] imagefile srcpath [dstpath]
+ minget --offset bytes [--length bytes] [...] imagefile srcpath [dstpath]
+ minget --uring[=depth] [...] imagefile srcpath dstpath
+ minget --pipeline[=buffers] [...] imagefile srcpath [dstpath]
+
+ *The recursive argument recreates the whole directory under dstdir, using
+ *    a pool of threads
+ *The stats argument prints what was read from the image, and by whom, to
+ *    stderr at the end
+ *The trace argument writes how long each phase took to a file, in Chrome
+ *    trace-event format
+ *The daemon argument has a running minfsd read the file instead of reading
+ *    the image here
+ *The offset and length arguments copy just that range of the file, only
+ *    reading the zones (and indirect blocks) it covers
+ *The uring argument copies through io_uring, keeping up to depth reads and
+ *    writes in flight across every zone of every file (each thread of -r
+ *    gets its own ring). Without io_uring it quietly copies the usual way.
+ *The pipeline argument reads the image on one thread while writing the
+ *    file on another, with buffers chunks in between, for destinations
+ *    that are slow to write
 */
 
 #include "minfs.h"
 #include <time.h>
+#include <getopt.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 /*To stop gcc from yelling at me about how minfs doesn't use the below
  *variables, I have moved them from minfs.h to here.*/
@@ -24,36 +50,81 @@ static char *inodeFields[numInodeFields] = {"uint16_t mode", "uint16_t links",
 					    "uint32_t size", "uint32_t atime",
 					    "uint32_t mtime","uint32_t ctime"};
 
+/*Options that only have a long form*/
+static struct option longOptions[] = {
+  {"stats", optional_argument, NULL, OPT_STATS},
+  {"trace", required_argument, NULL, OPT_TRACE},
+  {"daemon", required_argument, NULL, OPT_DAEMON},
+  {"offset", required_argument, NULL, OPT_OFFSET},
+  {"length", required_argument, NULL, OPT_LENGTH},
+  {"uring", optional_argument, NULL, OPT_URING},
+  {"pipeline", optional_argument, NULL, OPT_PIPELINE},
+  {NULL, 0, NULL, 0}
+};
+
+/*One file or directory to extract*/
+typedef struct get_node
+{
+  int iNum;   /*Inode number in the image*/
+  char *path; /*Where it goes on the host*/
+} *getNode;
+
+/*Everything the workers of a recursive extraction share*/
+typedef struct get_job
+{
+  tools target;
+  unsigned char *visited; /*Directories that already have a node*/
+  char **linked;          /*Host path of each hard linked inode, once made*/
+  pthread_mutex_t lock;   /*Protects linked*/
+  uring *rings;           /*Each worker's io_uring, NULL to copy directly*/
+} *getJob;
+
 /*Clean up everything so it looks nice and neat*/
 void cleanup(tools target, char *imageFile, char **path, int depth)
 {
-  int i;
-  
   /*If a path was provided*/
   if(path)
     free(path);
 
-  for(i = 0; i < target->numFiles; i++)
+  free(imageFile);
+
+  /*The listing lives in the tools' arena, so this frees it too*/
+  closeTools(target);
+}
+
+/*Copies the file with minfsd doing the reading*/
+void remoteGet(char *sockPath, char *imageFile, int partition, int subpart,
+	       char **path, int depth, FILE *dest)
+{
+  struct daemon_reply reply;
+  char *image;
+  arena mem;
+  int sock;
+
+  /*minfsd doesn't share our working directory*/
+  if( !(image = realpath(imageFile, NULL)) )
   {
-    free(target->files[i]->entry);
-    free(target->files[i]->perms);
-    free(target->files[i]);
+    perror(imageFile);
+    exit(EXIT_FAILURE);
   }
 
-  free(target->files);
-  
-  free(imageFile);
-  
-  free(target->inode);
-  free(target->superblock);
-  free(target);
+  mem = makeArena(ARENA_BLOCK);
+  sock = daemonAsk(sockPath, DAEMON_READ, image, partition, subpart,
+		   daemonPath(path, depth, mem), &reply, mem);
+  if(sock < 0 || recvContents(sock, &reply, dest) < 0)
+    exit(EXIT_FAILURE);
+
+  close(sock);
+  freeArena(mem);
+  free(image);
 }
 
 /*Prints usage*/
 void usage()
 {
   fprintf(stderr,
-	  "usage: minls [-v] [-p num [-s num]] imagefile [path]\n");
+	  "usage: minget [-v] [-r [-j num]] [-b bytes] [-c blocks]"
+	  " [-p num [-s num]] imagefile srcpath [dstpath]\n");
   fprintf(stderr,
 	  "Options:\n");
   fprintf(stderr,
@@ -61,6 +132,33 @@ void usage()
   fprintf(stderr,
 	  "-s  sub     --- select subpartition"
 	 " for filesystem (default: none)\n");
+  fprintf(stderr,
+	  "-b  bytes   --- largest single copy (default: %d)\n", MAX_IO);
+  fprintf(stderr,
+	  "-c  blocks  --- inode table blocks to cache (default: %d)\n",
+	  INODE_CACHE);
+  fprintf(stderr,
+	  "-r  recurse --- copy the directory srcpath and everything under"
+	  " it to dstpath\n");
+  fprintf(stderr,
+	  "-j  threads --- with -r, number of threads (default: cpus)\n");
+  fprintf(stderr,
+	  "--stats[=table|json] --- print I/O statistics to stderr\n");
+  fprintf(stderr,
+	  "--trace file --- write a timeline of each phase to file\n");
+  fprintf(stderr,
+	  "--daemon socket --- ask the minfsd at socket instead\n");
+  fprintf(stderr,
+	  "--offset bytes  --- start copying this far into the file"
+	  " (default: 0)\n");
+  fprintf(stderr,
+	  "--length bytes  --- copy at most this much (default: the rest)\n");
+  fprintf(stderr,
+	  "--uring[=depth] --- copy through io_uring with up to depth"
+	  " operations queued (default: %d)\n", URING_DEPTH);
+  fprintf(stderr,
+	  "--pipeline[=buffers] --- read and write on separate threads,"
+	  " buffers chunks apart (default: %d)\n", PIPE_BUFS);
   fprintf(stderr,
 	  "-h  help    --- print usage information and exit\n");
   fprintf(stderr,
@@ -73,6 +171,7 @@ void printInfo(tools target)
 {
   int i;
   time_t aTime, mTime, cTime;
+  char perms[PERM_LEN];
   
   /*Printing for the superblock*/
   fprintf(stderr, "\nSuperblock Contents:\nStored Fields:\n");
@@ -107,7 +206,7 @@ void printInfo(tools target)
   /*Print the string permission as well*/
   fprintf(stderr, "  %-14s          0x%4X",
 	  inodeFields[0], target->inode->mode);
-  fprintf(stderr, " (%s)\n", target->perms);
+  fprintf(stderr, " (%s)\n", getMode(target->inode->mode, perms));
   fprintf(stderr, "  %-14s %15u\n", inodeFields[1], target->inode->links);
   fprintf(stderr, "  %-14s %15u\n", inodeFields[2], target->inode->uid);
   fprintf(stderr, "  %-14s %15u\n", inodeFields[3], target->inode->gid);
@@ -136,23 +235,233 @@ void printInfo(tools target)
 	  target->inode->indirect);
   fprintf(stderr, "  uint32_t double         %8d\n",
 	  target->inode->two_indirect);
+
+  /*How much memory the directory indexes took*/
+  fprintf(stderr, "\nDirectory indexes:\n");
+  fprintf(stderr, "  %-13s %11d\n", "indexed", target->indexes->numIndexes);
+  fprintf(stderr, "  %-13s %11ld (cap: %ld)\n", "bytes",
+	  target->indexes->bytes, target->indexes->cap);
+}
+
+/*Builds the host path of an entry from its directory's path*/
+char *childPath(char *parent, char *name)
+{
+  char *path;
+
+  path = malloc(strlen(parent) + strlen(name) + 2);
+  sprintf(path, "%s/%s", parent, name);
+
+  return path;
+}
+
+/*Makes a node for something that still has to be extracted*/
+getNode makeNode(int iNum, char *path)
+{
+  getNode node;
+
+  node = malloc(sizeof(struct get_node));
+  node->iNum = iNum;
+  node->path = path;
+
+  return node;
+}
+
+/*Copies one regular file out. An inode with more than one link is only
+ *copied the first time it is found, after that it just gets linked to.*/
+void getFile(getJob job, int worker, getNode node, inode file)
+{
+  int fd;
+
+  pthread_mutex_lock(&job->lock);
+
+  if(file->links > 1 && job->linked[node->iNum])
+  {
+    pthread_mutex_unlock(&job->lock);
+
+    if( link(job->linked[node->iNum], node->path) < 0 )
+      perror(node->path);
+    return;
+  }
+
+  /*Created while still locked, so anyone linking to it finds it there*/
+  if( (fd = open(node->path, O_WRONLY | O_CREAT | O_TRUNC,
+		 file->mode & 0777)) < 0 )
+  {
+    pthread_mutex_unlock(&job->lock);
+    perror(node->path);
+    return;
+  }
+
+  if(file->links > 1)
+  {
+    job->linked[node->iNum] = node->path;
+    node->path = NULL;
+  }
+
+  pthread_mutex_unlock(&job->lock);
+
+  /*The ring closes fd itself once the copy lands*/
+  if(job->rings && job->rings[worker])
+  {
+    uringCopy(job->rings[worker], file, fd);
+    return;
+  }
+
+  writeFile(job->target, file, fd);
+
+  if( close(fd) < 0 )
+    perror("getFile - close");
+}
+
+/*Makes one directory and hands everything in it back to the pool*/
+void getDir(pool p, int worker, getJob job, getNode node)
+{
+  dirList files;
+  struct inode folder;
+  arena mem;
+  int i, childNum;
+  char *path, *name;
+
+  getInode(job->target, node->iNum, &folder);
+  mem = makeArena(ARENA_BLOCK);
+  files = readListing(job->target, &folder, mem);
+
+  for(i = 0; i < files->count; i++)
+  {
+    name = LISTNAME(files, i);
+
+    /*. and .. are already there, and names can't leave the directory*/
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strchr(name, '/'))
+      continue;
+
+    childNum = files->inodes[i];
+
+    /*Skip directories already made (a broken image could loop)*/
+    if(ISDIR(files->modes[i]) &&
+       __atomic_exchange_n(&job->visited[childNum], 1, __ATOMIC_RELAXED))
+      continue;
+
+    path = childPath(node->path, name);
+
+    /*Directories are made here so the files in them have somewhere to go*/
+    if(ISDIR(files->modes[i]) && mkdir(path, 0777) < 0 && errno != EEXIST)
+    {
+      perror(path);
+      free(path);
+      continue;
+    }
+
+    poolSubmit(p, worker, makeNode(childNum, path));
+  }
+
+  freeArena(mem);
 }
 
+/*What each worker does with a node: make the directory or copy the file*/
+void getTask(pool p, int worker, void *task, void *arg)
+{
+  getJob job;
+  getNode node;
+  struct inode file;
+
+  job = arg;
+  node = task;
+
+  getInode(job->target, node->iNum, &file);
+
+  if(ISDIR(file.mode))
+    getDir(p, worker, job, node);
+  else if(ISREG(file.mode))
+    getFile(job, worker, node, &file);
+  else
+    fprintf(stderr, "Skipping '%s', not a regular file or directory.\n",
+	    node->path);
+
+  free(node->path);
+  free(node);
+}
+
+/*Recreates the target directory and everything under it at dstPath with a
+ *pool of threads. A depth above 0 gives each thread an io_uring that deep.*/
+void getTree(tools target, char *dstPath, int threads, int depth)
+{
+  struct get_job job;
+  uint32_t i;
+  char *rootPath;
+  pool p;
+
+  if( mkdir(dstPath, 0777) < 0 && errno != EEXIST )
+  {
+    perror(dstPath);
+    exit(EXIT_FAILURE);
+  }
+
+  job.target = target;
+  job.visited = calloc(target->superblock->ninodes + 1, sizeof(char));
+  job.linked = calloc(target->superblock->ninodes + 1, sizeof(char *));
+  pthread_mutex_init(&job.lock, NULL);
+
+  job.visited[target->iNum] = 1;
+
+  /*Threads without a ring just copy directly*/
+  job.rings = NULL;
+  if(depth > 0)
+  {
+    job.rings = malloc(sizeof(uring) * threads);
+    for(i = 0; i < threads; i++)
+      job.rings[i] = makeUring(target, depth);
+  }
+
+  rootPath = malloc(strlen(dstPath) + 1);
+  strcpy(rootPath, dstPath);
+
+  p = makePool(threads, getTask, &job);
+  poolSubmit(p, -1, makeNode(target->iNum, rootPath));
+  finishPool(p);
+
+  /*Whatever the rings still have in flight has to land first*/
+  if(job.rings)
+  {
+    for(i = 0; i < threads; i++)
+      freeUring(job.rings[i]);
+    free(job.rings);
+  }
+
+  for(i = 0; i <= target->superblock->ninodes; i++)
+    free(job.linked[i]);
+
+  pthread_mutex_destroy(&job.lock);
+  free(job.linked);
+  free(job.visited);
+}
 
 int main(int argc, char *argv[])
 {
-  int i, depth, verbose, err;
-  long int partition, subpart;
+  int i, depth, verbose, err, recursive, haveSrc, stats;
+  long int partition, subpart, maxIO, cacheBlocks, threads, offset, length;
+  long int uringDepth, pipeBufs;
 
-  char *imageFile, **path, *destination, delim, *access;
+  char *imageFile, **path, *destination, delim, *access, *sockPath;
 
   FILE *image, *dest;
 
   tools target;
+  uring ring;
   
   verbose = 0;
   partition = -1;
   subpart = -1;
+  cacheBlocks = INODE_CACHE;
+  maxIO = MAX_IO;
+  recursive = 0;
+  threads = defaultWorkers();
+  haveSrc = 0;
+  stats = STATS_NONE;
+  sockPath = NULL;
+  offset = 0;
+  length = -1;
+  uringDepth = 0;
+  pipeBufs = 0;
 
   imageFile = NULL;
   path = NULL;
@@ -165,18 +474,70 @@ int main(int argc, char *argv[])
   }
   
   /*--- ARG PARSING ---*/
-  while((i = getopt(argc, argv, "vp:s:")) != -1)
+  while((i = getopt_long(argc, argv, "vrj:b:c:p:s:", longOptions,
+			 NULL)) != -1)
     switch(i)
     {
       case 'v':
     	  verbose = 1;
     	  break;
+      case 'r':
+	      recursive = 1;
+	      break;
+      case 'j':
+	      threads = strtol(optarg, NULL, 10);
+	      if(threads <= 0)
+	        usage();
+	      break;
+      case 'b':
+	      maxIO = strtol(optarg, NULL, 10);
+	      /*Anything smaller than a byte doesn't make sense*/
+	      if(maxIO <= 0)
+	        usage();
+	      break;
+      case 'c':
+	      cacheBlocks = strtol(optarg, NULL, 10);
+	      /*Need room for at least one block*/
+	      if(cacheBlocks <= 0)
+	        usage();
+	      break;
       case 'p':
 	      partition = strtol(optarg, NULL, 10);
 	      break;
       case 's':
 	      subpart = strtol(optarg, NULL, 10);
 	      break;
+      case OPT_STATS:
+	      if( (stats = statsFormat(optarg)) < 0 )
+	        usage();
+	      break;
+      case OPT_TRACE:
+	      if( startTrace(optarg) < 0 )
+	        exit(EXIT_FAILURE);
+	      break;
+      case OPT_DAEMON:
+	      sockPath = optarg;
+	      break;
+      case OPT_OFFSET:
+	      offset = strtol(optarg, NULL, 10);
+	      if(offset < 0)
+	        usage();
+	      break;
+      case OPT_LENGTH:
+	      length = strtol(optarg, NULL, 10);
+	      if(length < 0)
+	        usage();
+	      break;
+      case OPT_PIPELINE:
+	      pipeBufs = optarg ? strtol(optarg, NULL, 10) : PIPE_BUFS;
+	      if(pipeBufs <= 0)
+	        usage();
+	      break;
+      case OPT_URING:
+	      uringDepth = optarg ? strtol(optarg, NULL, 10) : URING_DEPTH;
+	      if(uringDepth <= 0)
+	        usage();
+	      break;
       case '?':
 	      usage();
 	      break;
@@ -197,10 +558,11 @@ int main(int argc, char *argv[])
     }
     
     /*Now for the file path*/    
-    else if(!path)
+    else if(!haveSrc)
     {
       char *temp;
       
+      haveSrc = 1;
       depth = 0;
       delim = '/';
       
@@ -231,9 +593,34 @@ int main(int argc, char *argv[])
     }
   }
 
-  /*An imagefile and source path are mandatory*/
-  if(!imageFile || !path)
+  /*An imagefile and source path are mandatory, and -r needs somewhere to
+   *put everything*/
+  if(!imageFile || !haveSrc || (recursive && !destination))
     usage();
+
+  /*Ranges are of a single file*/
+  if((recursive || sockPath) && (offset != 0 || length >= 0))
+  {
+    fprintf(stderr,
+	    "--offset and --length don't work with -r or --daemon.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /*io_uring writes at offsets, so it needs a real file to write to*/
+  if(uringDepth && (sockPath || !destination || offset != 0 || length >= 0))
+  {
+    fprintf(stderr, "--uring needs dstpath, and doesn't work with --daemon,"
+	    " --offset or --length.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /*The pipeline is for copying one file locally*/
+  if(pipeBufs && (recursive || sockPath || uringDepth))
+  {
+    fprintf(stderr,
+	    "--pipeline doesn't work with -r, --daemon or --uring.\n");
+    exit(EXIT_FAILURE);
+  }
   
   /*--- END PARSING ARGS ---*/
   
@@ -250,8 +637,11 @@ int main(int argc, char *argv[])
   /*Set up write access*/
   access = "w+";
   
-  /*Attempt to open destination for writing (if it exists)*/
-  if(destination)
+  /*Attempt to open destination for writing (if it exists). -r makes its
+   *own directory instead.*/
+  if(recursive)
+    dest = NULL;
+  else if(destination)
   {
     if( !(dest = fopen(destination, access)))
     {
@@ -264,9 +654,25 @@ int main(int argc, char *argv[])
     /*If no destination was given, write to stdout*/
     dest = stdout;
   }
+
+  /*minfsd has the image open already*/
+  if(sockPath)
+  {
+    if(recursive || verbose || stats)
+    {
+      fprintf(stderr, "-r, -v and --stats don't work with --daemon.\n");
+      exit(EXIT_FAILURE);
+    }
+
+    remoteGet(sockPath, imageFile, partition, subpart, path, depth, dest);
+    fclose(image);
+    free(path);
+    free(imageFile);
+    return 0;
+  }
     
   /*Get the superblock and inode information*/
-  target = getSuper(image, partition, subpart);
+  target = getSuper(image, partition, subpart, ACCESS_MAP);
 
   /*If the target is null*/
   if(!target)
@@ -274,6 +680,10 @@ int main(int argc, char *argv[])
     fprintf(stderr, "This doesn't look like a minix file system.\n");
     exit(EXIT_FAILURE);
   }
+
+  /*Size the inode cache if asked to*/
+  if(cacheBlocks != INODE_CACHE)
+    setInodeCache(target, cacheBlocks);
   
   /*Find the correct folder in the file system, if path is provided*/
   if(path)
@@ -292,7 +702,31 @@ int main(int argc, char *argv[])
   /*If no path is specified, get the root inode*/
   else
   {
-    target->inode = getInode(target, 1);
+    target->iNum = 1;
+    target->inode = getInode(target, 1, &target->inodeBuf);
+  }
+
+  /*Directories can be copied recursively*/
+  if(recursive)
+  {
+    if(!ISDIR(target->inode->mode))
+    {
+      fprintf(stderr, "minget -r copies directories only.\n");
+      exit(EXIT_FAILURE);
+    }
+
+    if(verbose)
+      printInfo(target);
+
+    target->maxIO = maxIO;
+    target->numFiles = 0;
+    getTree(target, destination, threads, uringDepth);
+    if(stats)
+      printStats(target, stats);
+
+    free(destination);
+    cleanup(target, imageFile, path, depth);
+    return 0;
   }
 
   /*If this is not a regular file, error*/
@@ -307,7 +741,25 @@ int main(int argc, char *argv[])
     printInfo(target);
   
   /*Output file*/
-  readFile(target, dest);
+  target->maxIO = maxIO;
+  if(pipeBufs)
+    readPipelined(target, target->inode, dest, offset,
+		  length >= 0 ? length : target->inode->size, pipeBufs);
+  else if(offset != 0 || length >= 0)
+    readRange(target, target->inode, dest, offset,
+	      length >= 0 ? length : target->inode->size);
+  else if(uringDepth && (ring = makeUring(target, uringDepth)))
+  {
+    /*The ring gets its own descriptor for the file, and closes it*/
+    uringCopy(ring, target->inode, dup(fileno(dest)));
+    freeUring(ring);
+  }
+  else
+    readFile(target, target->inode, dest);
+
+  /*Say what it took*/
+  if(stats)
+    printStats(target, stats);
   
   /*Clean up our mess*/
   cleanup(target, imageFile, path, depth);
@@ -0,0 +1,250 @@
+/*This file contains the image access layer. Instead of seeking and reading
+ *through the FILE * for every structure, the whole image is mapped into
+ *memory once and everything else just hands out pointers into it. When
+ *mapping isn't possible (or isn't wanted) reads are done with pread into a
+ *buffer the caller provides, so there is never a shared file position and
+ *any number of threads can read at once. Compressed images (see minzimg.c)
+ *are always read that way, a chunk at a time.
+ */
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "minfs.h"
+
+/*How much to grow the buffer by when an image has to be read in by hand*/
+#define SLURP_CHUNK (1 << 20)
+
+/*Names of the callers in IO_* order, for messages and statistics*/
+static char *ioNames[IO_CALLERS] =
+  {"findPart", "getSuper", "getInode", "readFEnt", "readZone", "readBlock",
+   "readFile", "getUsage"};
+
+/*Where this thread goes when the image turns out to be damaged, NULL to
+ *just exit*/
+static __thread jmp_buf *damageJump;
+
+/*Fallback for images we can't mmap (pipes, character devices, etc.). The
+ *whole stream is read into a heap buffer so the rest of the library doesn't
+ *have to care where the bytes came from.*/
+static void slurpImage(imgMap map)
+{
+  long capacity;
+  size_t got;
+
+  capacity = 0;
+  map->data = NULL;
+  map->size = 0;
+
+  do
+  {
+    /*Make sure there is at least one chunk of room left*/
+    if(map->size + SLURP_CHUNK > capacity)
+    {
+      capacity += SLURP_CHUNK;
+      if( !(map->data = realloc(map->data, capacity)) )
+      {
+	perror("openImage - realloc");
+	exit(EXIT_FAILURE);
+      }
+    }
+
+    got = fread(map->data + map->size, sizeof(char), SLURP_CHUNK, map->image);
+    map->size += got;
+  } while(got == SLURP_CHUNK);
+
+  if( ferror(map->image) )
+  {
+    perror("openImage - fread");
+    exit(EXIT_FAILURE);
+  }
+
+  map->mapped = 0;
+  map->direct = 1;
+}
+
+/*This function maps the given image into memory (unless access says to use
+ *pread). If it can't be mapped but can be seeked, pread is used, and if it
+ *can't even be seeked the whole stream gets read in. A compressed image is
+ *read like a pread image the size it was before being compressed.*/
+imgMap openImage(FILE *image, int access)
+{
+  imgMap map;
+  struct stat info;
+  void *data;
+  off_t end;
+
+  map = malloc(sizeof(struct image_map));
+  map->image = image;
+  map->fd = fileno(image);
+  map->data = NULL;
+  map->mapped = 0;
+  map->direct = 0;
+  map->reads = 0;
+  map->preads = 0;
+  map->bytes = 0;
+  map->seeks = 0;
+  map->next = 0;
+  memset(map->io, 0, sizeof(map->io));
+  map->zimg = NULL;
+
+  /*Compressed images say so at the end*/
+  if( fstat(map->fd, &info) == 0 && S_ISREG(info.st_mode) &&
+      (map->zimg = openZimg(map->fd)) )
+  {
+    map->size = map->zimg->size;
+    return map;
+  }
+
+  /*Only regular files have a size we can map*/
+  if( access == ACCESS_MAP && fstat(map->fd, &info) == 0 &&
+      S_ISREG(info.st_mode) && info.st_size > 0 )
+  {
+    data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, map->fd, 0);
+
+    if(data != MAP_FAILED)
+    {
+      map->data = data;
+      map->size = info.st_size;
+      map->mapped = 1;
+      map->direct = 1;
+      return map;
+    }
+  }
+
+  /*Anything we can seek in (files, block devices) can use pread*/
+  if( (end = lseek(map->fd, 0, SEEK_END)) > 0 )
+  {
+    map->size = end;
+    return map;
+  }
+
+  /*Couldn't map it, read the whole thing instead*/
+  slurpImage(map);
+
+  return map;
+}
+
+/*Unmaps (or frees) the image contents. The FILE * belongs to the caller.*/
+void closeImage(imgMap map)
+{
+  if(!map)
+    return;
+
+  if(map->mapped)
+    munmap(map->data, map->size);
+  else if(map->direct)
+    free(map->data);
+
+  closeZimg(map->zimg);
+
+  free(map);
+}
+
+/*Name of one of the IO_* callers*/
+char *ioName(int caller)
+{
+  return ioNames[caller];
+}
+
+/*Counts a read of len bytes at offset against the given caller. Any thread
+ *might be here, and nothing waits on these, so they are only kept atomic.*/
+void countRead(imgMap map, int caller, long offset, long len)
+{
+  long last;
+
+  __atomic_add_fetch(&map->reads, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&map->bytes, len, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&map->io[caller].reads, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&map->io[caller].bytes, len, __ATOMIC_RELAXED);
+
+  /*Anything not picking up where the last read left off is a seek (with
+   *more than one thread this is only roughly right)*/
+  last = __atomic_exchange_n(&map->next, offset + len, __ATOMIC_RELAXED);
+  if(last != offset)
+  {
+    __atomic_add_fetch(&map->seeks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&map->io[caller].seeks, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/*Returns a pointer to len bytes of the image at the given offset. If the
+ *image is in memory that is a pointer straight into it, otherwise the bytes
+ *are pread into scratch (which must hold len bytes) and scratch is returned.
+ *Anything that would run off the end of the image is treated the same way a
+ *failed fread used to be: report who asked and bail (see imgFail). caller
+ *is one of the IO_* values, the read is counted against it.*/
+void *imgRead(imgMap map, long offset, long len, void *scratch, int caller)
+{
+  ssize_t got;
+  long total;
+
+  if(offset < 0 || len < 0 || offset > map->size - len)
+  {
+    fprintf(stderr, "%s - read past end of image (offset %ld)\n",
+	    ioNames[caller], offset);
+    imgFail();
+  }
+
+  countRead(map, caller, offset, len);
+
+  if(map->direct)
+    return map->data + offset;
+
+  if(map->zimg)
+    return zimgRead(map, offset, len, scratch, caller);
+
+  /*pread can come up short, keep going until we have all of it*/
+  for(total = 0; total < len; total += got)
+  {
+    got = pread(map->fd, (char *)scratch + total, len - total,
+		offset + total);
+    __atomic_add_fetch(&map->preads, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&map->io[caller].preads, 1, __ATOMIC_RELAXED);
+
+    if(got < 0 && errno == EINTR)
+    {
+      got = 0;
+      continue;
+    }
+
+    /*Nothing at all means the file got shorter under us*/
+    if(got == 0)
+    {
+      fprintf(stderr, "%s - image cut short (offset %ld)\n",
+	      ioNames[caller], offset + total);
+      imgFail();
+    }
+
+    if(got < 0)
+    {
+      perror(ioNames[caller]);
+      imgFail();
+    }
+  }
+
+  return scratch;
+}
+
+/*Makes damage this thread finds in an image (reads past the end, bad inode
+ *numbers, chunks that won't decompress) longjmp to where instead of
+ *exiting, or exit again if where is NULL. Returns what was set before, so
+ *it can be put back. Nothing the library holds a lock over can fail, so a
+ *long running program (minfsd) can answer with an error and carry on.*/
+jmp_buf *catchDamage(jmp_buf *where)
+{
+  jmp_buf *before;
+
+  before = damageJump;
+  damageJump = where;
+  return before;
+}
+
+/*Gives up on the image, once whatever is wrong has been printed*/
+void imgFail(void)
+{
+  if(damageJump)
+    longjmp(*damageJump, 1);
+
+  exit(EXIT_FAILURE);
+}
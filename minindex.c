@@ -0,0 +1,373 @@
+/*This file contains the directory index and the dentry cache. The first
+ *time a big directory is searched, all of its entries get put into a hash
+ *table so every later lookup in that directory doesn't have to scan it
+ *again. On top of that, every (directory, name) lookup that findFolder does
+ *is remembered, including the ones that found nothing.
+ */
+
+#include "minfs.h"
+
+/*Hashes at most the first 60 bytes of a name (FNV-1a)*/
+static uint32_t hashName(char *name)
+{
+  uint32_t hash;
+  int i;
+
+  hash = 2166136261u;
+
+  for(i = 0; i < 60 && name[i]; i++)
+  {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/*Sets up an empty set of directory indexes that may use up to cap bytes*/
+void setIndexCap(tools target, long cap)
+{
+  freeIndexes(target->indexes);
+
+  target->indexes = malloc(sizeof(struct index_set));
+  target->indexes->buckets = calloc(INDEX_BUCKETS, sizeof(dirIndex));
+  target->indexes->numIndexes = 0;
+  target->indexes->bytes = 0;
+  target->indexes->cap = cap;
+  pthread_mutex_init(&target->indexes->lock, NULL);
+}
+
+/*Frees a single index*/
+static void freeIndex(dirIndex index)
+{
+  free(index->entries);
+  free(index->table);
+  free(index);
+}
+
+/*Frees every directory index in the set*/
+void freeIndexes(indexSet set)
+{
+  dirIndex index, next;
+  int i;
+
+  if(!set)
+    return;
+
+  for(i = 0; i < INDEX_BUCKETS; i++)
+    for(index = set->buckets[i]; index; index = next)
+    {
+      next = index->next;
+      freeIndex(index);
+    }
+
+  pthread_mutex_destroy(&set->lock);
+  free(set->buckets);
+  free(set);
+}
+
+/*Looks for an index that was already built for the given directory*/
+static dirIndex findIndex(indexSet set, int dirNum)
+{
+  dirIndex index;
+
+  for(index = set->buckets[dirNum % INDEX_BUCKETS]; index;
+      index = index->next)
+    if(index->dirNum == dirNum)
+      return index;
+
+  return NULL;
+}
+
+/*How much memory an index of the given directory will take, going by the
+ *worst case of every slot being in use*/
+static long indexBytes(inode folder, int *size)
+{
+  /*Table size is a power of two at least twice the number of slots*/
+  *size = 1;
+  while(*size < 2 * (folder->size / DIR_SIZE))
+    *size *= 2;
+
+  return sizeof(struct dir_index) + (long)*size * sizeof(int) +
+    (folder->size / DIR_SIZE) * (long)sizeof(struct directory_entry);
+}
+
+/*Makes an empty index with room for every entry the directory could have*/
+static dirIndex makeIndex(int dirNum, inode folder)
+{
+  dirIndex index;
+  int size;
+
+  indexBytes(folder, &size);
+
+  index = malloc(sizeof(struct dir_index));
+  index->dirNum = dirNum;
+  index->size = size;
+  index->count = 0;
+  index->table = malloc(sizeof(int) * size);
+  memset(index->table, -1, sizeof(int) * size);
+  index->entries = malloc(folder->size / DIR_SIZE *
+			  sizeof(struct directory_entry));
+
+  return index;
+}
+
+/*Scans the directory once and fills in the hash table for it. The walk
+ *comes out of scratch.*/
+static void buildIndex(tools target, dirIndex index, inode folder,
+		       arena scratch)
+{
+  dirIter iter;
+  fileEnt file;
+  uint32_t slot;
+  int size, count;
+  double start;
+
+  start = traceStart();
+  size = index->size;
+
+  /*Copy every entry in and hash its name*/
+  count = 0;
+  iter = openDir(target, folder, scratch);
+
+  while( (file = nextEnt(iter)) )
+  {
+    slot = hashName((char *)file->name) & (size - 1);
+
+    /*Linear probing, stopping early for a name we've already seen (the
+     *first one wins, same as a scan)*/
+    while(index->table[slot] >= 0 &&
+	  strncmp((char *)index->entries[index->table[slot]].name,
+		  (char *)file->name, 60) != 0)
+      slot = (slot + 1) & (size - 1);
+
+    if(index->table[slot] < 0)
+    {
+      index->entries[count] = *file;
+      index->table[slot] = count++;
+    }
+  }
+
+  closeDir(iter);
+
+  index->count = count;
+
+  traceSpan(start, "buildIndex", NULL, "\"dir\":%d,\"entries\":%d",
+	    index->dirNum, count);
+}
+
+/*Looks up a name in the directory's index, building the index first if
+ *this directory hasn't been indexed yet. Returns 0 if the directory can't
+ *be indexed (too small to bother, or over the cap), in which case the
+ *caller should scan it. Otherwise *child is set to the inode number of the
+ *match, or 0 if there isn't one. Anything the scan needs comes out of
+ *scratch.*/
+int indexLookup(tools target, int dirNum, inode folder, char *string,
+		uint32_t *child, arena scratch)
+{
+  jmp_buf damaged, *outer;
+  indexSet set;
+  dirIndex index, built;
+  uint32_t slot;
+  long bytes;
+  int size;
+
+  set = target->indexes;
+
+  /*Small directories are quicker to just scan*/
+  if(folder->size / DIR_SIZE < INDEX_MIN)
+    return 0;
+
+  pthread_mutex_lock(&set->lock);
+  index = findIndex(set, dirNum);
+  pthread_mutex_unlock(&set->lock);
+
+  if(!index)
+  {
+    /*Check the worst case against the cap before bothering*/
+    bytes = indexBytes(folder, &size);
+
+    pthread_mutex_lock(&set->lock);
+    if(set->bytes + bytes > set->cap)
+    {
+      pthread_mutex_unlock(&set->lock);
+      return 0;
+    }
+    /*Hold the room for it while it gets built*/
+    set->bytes += bytes;
+    pthread_mutex_unlock(&set->lock);
+
+    /*Built without the lock, so other lookups aren't held up by the scan.
+     *A directory that turns out to be damaged gives back its room and what
+     *was built before passing the damage on.*/
+    built = makeIndex(dirNum, folder);
+    outer = catchDamage(&damaged);
+    if( setjmp(damaged) )
+    {
+      catchDamage(outer);
+      freeIndex(built);
+      pthread_mutex_lock(&set->lock);
+      set->bytes -= bytes;
+      pthread_mutex_unlock(&set->lock);
+      imgFail();
+    }
+
+    buildIndex(target, built, folder, scratch);
+    catchDamage(outer);
+
+    pthread_mutex_lock(&set->lock);
+
+    /*Someone else may have indexed it in the meantime*/
+    if( (index = findIndex(set, dirNum)) )
+    {
+      set->bytes -= bytes;
+      freeIndex(built);
+    }
+    else
+    {
+      index = built;
+      index->next = set->buckets[dirNum % INDEX_BUCKETS];
+      set->buckets[dirNum % INDEX_BUCKETS] = index;
+      set->numIndexes++;
+    }
+
+    pthread_mutex_unlock(&set->lock);
+  }
+
+  slot = hashName(string) & (index->size - 1);
+
+  /*Walk the probe sequence until a match or an empty slot*/
+  while(index->table[slot] >= 0)
+  {
+    if( strncmp(string, (char *)index->entries[index->table[slot]].name,
+		60) == 0 )
+    {
+      *child = index->entries[index->table[slot]].inode;
+      return 1;
+    }
+
+    slot = (slot + 1) & (index->size - 1);
+  }
+
+  *child = 0;
+  return 1;
+}
+
+/*Empties the dentry cache, the caller holds its lock*/
+static void emptyDentries(dentCache cache)
+{
+  dentry dent, next;
+  int i;
+
+  for(i = 0; i < DENTRY_BUCKETS; i++)
+  {
+    for(dent = cache->buckets[i]; dent; dent = next)
+    {
+      next = dent->next;
+      free(dent);
+    }
+    cache->buckets[i] = NULL;
+  }
+
+  cache->count = 0;
+}
+
+/*Empties the dentry cache (or sets one up if there isn't one yet)*/
+void clearDentries(tools target)
+{
+  dentCache cache;
+
+  if( !(cache = target->dentries) )
+  {
+    cache = malloc(sizeof(struct dentry_cache));
+    cache->buckets = calloc(DENTRY_BUCKETS, sizeof(dentry));
+    cache->count = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+    target->dentries = cache;
+    return;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  emptyDentries(cache);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/*Frees the dentry cache entirely*/
+void freeDentries(tools target)
+{
+  if(!target->dentries)
+    return;
+
+  clearDentries(target);
+  pthread_mutex_destroy(&target->dentries->lock);
+  free(target->dentries->buckets);
+  free(target->dentries);
+  target->dentries = NULL;
+}
+
+/*Which bucket a (parent, name) pair goes in*/
+static int dentBucket(int parent, char *name)
+{
+  return (hashName(name) ^ ((uint32_t)parent * 2654435761u)) %
+    DENTRY_BUCKETS;
+}
+
+/*Looks up name in the directory with inode number parent. Returns 1 and
+ *sets *child if the answer is cached (a child of 0 means the name is known
+ *not to be there), or 0 if the directory has to be searched.*/
+int findDentry(tools target, int parent, char *name, int *child)
+{
+  dentry dent;
+  int found;
+
+  found = 0;
+  pthread_mutex_lock(&target->dentries->lock);
+
+  for(dent = target->dentries->buckets[dentBucket(parent, name)]; dent;
+      dent = dent->next)
+  {
+    if(dent->parent == parent && strncmp(dent->name, name, 60) == 0)
+    {
+      *child = dent->child;
+      found = 1;
+      break;
+    }
+  }
+
+  if(found)
+    target->dentries->hits++;
+  else
+    target->dentries->misses++;
+
+  pthread_mutex_unlock(&target->dentries->lock);
+  return found;
+}
+
+/*Remembers the result of looking up name in parent. A child of 0 records
+ *that the name isn't there. When the cache is full it is started over.*/
+void addDentry(tools target, int parent, char *name, int child)
+{
+  dentry dent;
+  int bucket;
+
+  bucket = dentBucket(parent, name);
+
+  dent = malloc(sizeof(struct dentry));
+  dent->parent = parent;
+  dent->child = child;
+  strncpy(dent->name, name, 60);
+  dent->name[60] = '\0';
+
+  pthread_mutex_lock(&target->dentries->lock);
+
+  if(target->dentries->count >= DENTRY_MAX)
+    emptyDentries(target->dentries);
+
+  dent->next = target->dentries->buckets[bucket];
+  target->dentries->buckets[bucket] = dent;
+  target->dentries->count++;
+
+  pthread_mutex_unlock(&target->dentries->lock);
+}
@@ -1,14 +1,27 @@
 /*minls is a unix program that reads the contents of a minix file system image
  *usage:
 
- minls [-v] [-p partion [-s subpart]] imagefile [path]
+ minls [-v] [-R [-U] [-j threads]] [-o order] [-c blocks]
+       [--stats[=table|json]] [--trace file] [--daemon socket]
+       [-p partion [-s subpart]] imagefile [path]
 
  *The verbose argument prints out the partition table, superblock, and inode
  *    of the source file/directory to stderr
+ *The recursive argument lists every directory under the path as well, using
+ *    a pool of threads
+ *The order argument sorts each directory by name or size instead of
+ *    listing it in the order it is stored
+ *The stats argument prints what was read from the image, and by whom, to
+ *    stderr at the end
+ *The trace argument writes how long each phase took to a file, in Chrome
+ *    trace-event format
+ *The daemon argument asks a running minfsd for the listing instead of
+ *    reading the image here (not with -R or -v)
  */
 
 #include "minfs.h"
 #include <time.h>
+#include <getopt.h>
 
 /*To stop gcc from yelling at me about how minfs doesn't use the below
  *variables, I have moved them from minfs.h to here.*/
@@ -25,39 +38,69 @@ static char *inodeFields[numInodeFields] = {"uint16_t mode", "uint16_t links",
 					    "uint32_t size", "uint32_t atime",
 					    "uint32_t mtime","uint32_t ctime"};
 
+/*Options that only have a long form*/
+static struct option longOptions[] = {
+  {"stats", optional_argument, NULL, OPT_STATS},
+  {"trace", required_argument, NULL, OPT_TRACE},
+  {"daemon", required_argument, NULL, OPT_DAEMON},
+  {NULL, 0, NULL, 0}
+};
+
+/*One directory in a recursive listing*/
+typedef struct list_node
+{
+  int iNum;                    /*Inode number of the directory*/
+  char *path;                  /*Path to print for the directory*/
+  char *output;                /*The directory's listing, once done*/
+  size_t outLen;               /*Length of output*/
+  int numChildren;             /*Number of subdirectories*/
+  struct list_node **children; /*Subdirectories, in listing order*/
+  int done;                    /*1 once output and children are filled in*/
+} *listNode;
+
+/*Everything the workers of a recursive listing share*/
+typedef struct list_job
+{
+  tools target;
+  int ordered;             /*1 to print in the same order as one thread*/
+  int order;               /*How to sort each directory (SORT_...)*/
+  int printed;             /*Number of directories printed so far*/
+  unsigned char *visited;  /*Directories that already have a node*/
+  pthread_mutex_t lock;    /*Protects done flags, printed and stdout*/
+  pthread_cond_t finished; /*Signalled whenever a node is done*/
+} *listJob;
+
 /*Clean up everything so it looks nice and neat*/
 void cleanup(tools target, char *imageFile, char **path, int depth)
 {
-  int i;
-  
   /*If a path was provided*/
   if(path)
     free(path);
 
-  for(i = 0; i < target->numFiles; i++)
-  {
-    free(target->files[i]->entry);
-    free(target->files[i]->perms);
-    free(target->files[i]);
-  }
-
-  free(target->files);
-  
   free(imageFile);
-  
-  free(target->inode);
-  free(target->superblock);
-  free(target);
+
+  /*The listing lives in the tools' arena, so this frees it too*/
+  closeTools(target);
 }
 
 
 void usage()
 {
-  printf("usage: minls [-v] [-p num [-s num]] imagefile [path]\n");
+  printf("usage: minls [-v] [-R [-U] [-j num]] [-o order] [-c blocks]"
+	 " [-p num [-s num]] imagefile [path]\n");
   printf("Options:\n");
   printf("-p  part    --- select partition for filesystem (default: none)\n");
   printf("-s  sub     --- select subpartition"
 	 " for filesystem (default: none)\n");
+  printf("-c  blocks  --- inode table blocks to cache (default: %d)\n",
+	 INODE_CACHE);
+  printf("-R  recurse --- list every directory under the path too\n");
+  printf("-U  unorder --- with -R, print directories as they finish\n");
+  printf("-j  threads --- with -R, number of threads (default: cpus)\n");
+  printf("-o  order   --- sort by name or size (default: as stored)\n");
+  printf("--stats[=table|json] --- print I/O statistics to stderr\n");
+  printf("--trace file --- write a timeline of each phase to file\n");
+  printf("--daemon socket --- ask the minfsd at socket instead\n");
   printf("-h  help    --- print usage information and exit\n");
   printf("-v  verbose --- select partition for filesystem (default: none)\n");
   exit(EXIT_FAILURE);
@@ -68,6 +111,7 @@ void printInfo(tools target)
 {
   int i;
   time_t aTime, mTime, cTime;
+  char perms[PERM_LEN];
   
   /*Printing for the superblock*/
   fprintf(stderr, "\nSuperblock Contents:\nStored Fields:\n");
@@ -102,7 +146,7 @@ void printInfo(tools target)
   /*Print the string permission as well*/
   fprintf(stderr, "  %-14s          0x%4X",
 	  inodeFields[0], target->inode->mode);
-  fprintf(stderr, " (%s)\n", target->perms);
+  fprintf(stderr, " (%s)\n", getMode(target->inode->mode, perms));
   fprintf(stderr, "  %-14s %15u\n", inodeFields[1], target->inode->links);
   fprintf(stderr, "  %-14s %15u\n", inodeFields[2], target->inode->uid);
   fprintf(stderr, "  %-14s %15u\n", inodeFields[3], target->inode->gid);
@@ -131,6 +175,12 @@ void printInfo(tools target)
 	  target->inode->indirect);
   fprintf(stderr, "  uint32_t double         %8d\n",
 	  target->inode->two_indirect);
+
+  /*How much memory the directory indexes took*/
+  fprintf(stderr, "\nDirectory indexes:\n");
+  fprintf(stderr, "  %-13s %11d\n", "indexed", target->indexes->numIndexes);
+  fprintf(stderr, "  %-13s %11ld (cap: %ld)\n", "bytes",
+	  target->indexes->bytes, target->indexes->cap);
 }
 
 /*Prints the path of the directory and its contents including: perms, size, 
@@ -138,6 +188,8 @@ void printInfo(tools target)
 void readDir(tools target, char **path, int depth)
 {
   int i;
+  char perms[PERM_LEN];
+
   /*If this is a directory*/
   if(ISDIR(target->inode->mode))
   {
@@ -154,13 +206,14 @@ void readDir(tools target, char **path, int depth)
 
     /*Print the contents*/
     for(i = 0; i < target->numFiles; i++)
-      printf("%s %9d %s\n", target->files[i]->perms,
-	      target->files[i]->size, target->files[i]->name);
+      printf("%s %9d %s\n", getMode(target->files->modes[i], perms),
+	     target->files->sizes[i], LISTNAME(target->files, i));
   }
   /*Otherwise this is a regular file*/
   else
   {
-    printf("%s %9d ", target->perms, target->inode->size);
+    printf("%s %9d ", getMode(target->inode->mode, perms),
+	   target->inode->size);
     /*Print path*/
     for(i = 0; i < depth; i++)
       printf("/%s", path[i]);
@@ -168,12 +221,234 @@ void readDir(tools target, char **path, int depth)
   }
 }
 
+/*Lists the path the same way, but with minfsd doing the reading. The
+ *reply and listing stand in for the tools readDir would normally get.*/
+void remoteList(char *sockPath, char *imageFile, int partition, int subpart,
+		char **path, int depth, int order)
+{
+  struct daemon_reply reply;
+  struct file_tools remote;
+  char *image;
+  arena mem;
+  int sock;
+
+  /*minfsd doesn't share our working directory*/
+  if( !(image = realpath(imageFile, NULL)) )
+  {
+    perror(imageFile);
+    exit(EXIT_FAILURE);
+  }
+
+  mem = makeArena(ARENA_BLOCK);
+  sock = daemonAsk(sockPath, DAEMON_LIST, image, partition, subpart,
+		   daemonPath(path, depth, mem), &reply, mem);
+  if(sock < 0)
+    exit(EXIT_FAILURE);
+
+  memset(&remote, 0, sizeof(remote));
+  remote.iNum = reply.iNum;
+  remote.inode = &reply.inode;
+
+  if(ISDIR(reply.inode.mode))
+  {
+    if( !(remote.files = recvListing(sock, &reply, mem)) )
+      exit(EXIT_FAILURE);
+    remote.numFiles = remote.files->count;
+    sortListing(remote.files, order, mem);
+  }
+
+  readDir(&remote, path, depth);
+
+  close(sock);
+  freeArena(mem);
+  free(image);
+}
+
+/*Builds the path of a subdirectory from its parent's path*/
+char *childPath(char *parent, char *name)
+{
+  char *path;
+
+  path = malloc(strlen(parent) + strlen(name) + 2);
+
+  /*The root's path is just the slash*/
+  if(strcmp(parent, "/") == 0)
+    sprintf(path, "/%s", name);
+  else
+    sprintf(path, "%s/%s", parent, name);
+
+  return path;
+}
+
+/*Makes a node for a directory that hasn't been listed yet*/
+listNode makeNode(int iNum, char *path)
+{
+  listNode node;
+
+  node = calloc(1, sizeof(struct list_node));
+  node->iNum = iNum;
+  node->path = path;
+
+  return node;
+}
+
+/*Writes out one finished directory (blank line between directories)*/
+void printNode(listJob job, listNode node)
+{
+  if(job->printed++ > 0)
+    printf("\n");
+
+  fwrite(node->output, sizeof(char), node->outLen, stdout);
+}
+
+/*Frees a node once it has been printed*/
+void freeNode(listNode node)
+{
+  free(node->output);
+  free(node->children);
+  free(node->path);
+  free(node);
+}
+
+/*What each worker does with a directory: list it into a buffer and hand
+ *every subdirectory back to the pool*/
+void listTask(pool p, int worker, void *task, void *arg)
+{
+  listJob job;
+  listNode node, child;
+  struct inode folder;
+  arena mem;
+  dirList files;
+  FILE *out;
+  int i, childNum;
+  char perms[PERM_LEN];
+
+  job = arg;
+  node = task;
+
+  getInode(job->target, node->iNum, &folder);
+  mem = makeArena(ARENA_BLOCK);
+  files = readListing(job->target, &folder, mem);
+  sortListing(files, job->order, mem);
+
+  /*Same format as readDir*/
+  out = open_memstream(&node->output, &node->outLen);
+  fprintf(out, "%s:\n", node->path);
+  for(i = 0; i < files->count; i++)
+    fprintf(out, "%s %9d %s\n", getMode(files->modes[i], perms),
+	    files->sizes[i], LISTNAME(files, i));
+  fclose(out);
+
+  node->children = malloc(sizeof(listNode) * (files->count + 1));
+
+  for(i = 0; i < files->count; i++)
+  {
+    /*Only directories get listed, and never . and .. again*/
+    if(!ISDIR(files->modes[i]) || strcmp(LISTNAME(files, i), ".") == 0 ||
+       strcmp(LISTNAME(files, i), "..") == 0)
+      continue;
+
+    /*Skip anything already listed (a broken image could loop)*/
+    childNum = files->inodes[i];
+    if( __atomic_exchange_n(&job->visited[childNum], 1, __ATOMIC_RELAXED) )
+      continue;
+
+    child = makeNode(childNum, childPath(node->path, LISTNAME(files, i)));
+    node->children[node->numChildren++] = child;
+    poolSubmit(p, worker, child);
+  }
+
+  freeArena(mem);
+
+  pthread_mutex_lock(&job->lock);
+
+  /*Unordered listings go out as soon as they're ready*/
+  if(!job->ordered)
+  {
+    printNode(job, node);
+    freeNode(node);
+  }
+  else
+  {
+    node->done = 1;
+    pthread_cond_broadcast(&job->finished);
+  }
+
+  pthread_mutex_unlock(&job->lock);
+}
+
+/*Lists the target directory and everything under it with a pool of
+ *threads. In ordered mode each directory is printed, followed by each of
+ *its subdirectories in turn, the same order one thread would go in.*/
+void listTree(tools target, char *rootPath, int ordered, int order,
+	      int threads)
+{
+  struct list_job job;
+  listNode root, node, *stack;
+  int top, max, i;
+  pool p;
+
+  job.target = target;
+  job.ordered = ordered;
+  job.order = order;
+  job.printed = 0;
+  job.visited = calloc(target->superblock->ninodes + 1, sizeof(char));
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.finished, NULL);
+
+  root = makeNode(target->iNum, rootPath);
+  job.visited[root->iNum] = 1;
+
+  p = makePool(threads, listTask, &job);
+  poolSubmit(p, -1, root);
+
+  /*Print each directory as soon as it and everything before it is done*/
+  if(ordered)
+  {
+    max = 64;
+    stack = malloc(sizeof(listNode) * max);
+    stack[0] = root;
+    top = 1;
+
+    while(top > 0)
+    {
+      node = stack[--top];
+
+      pthread_mutex_lock(&job.lock);
+      while(!node->done)
+	pthread_cond_wait(&job.finished, &job.lock);
+      pthread_mutex_unlock(&job.lock);
+
+      printNode(&job, node);
+
+      /*Children go on backwards so the first one comes off first*/
+      if(top + node->numChildren > max)
+      {
+	max = 2 * (top + node->numChildren);
+	stack = realloc(stack, sizeof(listNode) * max);
+      }
+      for(i = node->numChildren - 1; i >= 0; i--)
+	stack[top++] = node->children[i];
+
+      freeNode(node);
+    }
+
+    free(stack);
+  }
+
+  finishPool(p);
+
+  pthread_mutex_destroy(&job.lock);
+  pthread_cond_destroy(&job.finished);
+  free(job.visited);
+}
+
 int main(int argc, char *argv[])
 {
-  int i, depth, verbose, err;
-  long int partition, subpart;
+  int i, depth, verbose, err, recursive, ordered, order, stats;
+  long int partition, subpart, cacheBlocks, threads;
 
-  char *imageFile, **path, delim, read;
+  char *imageFile, **path, delim, read, *rootPath, *nextPath, *sockPath;
 
   FILE *image;
 
@@ -182,9 +457,17 @@ int main(int argc, char *argv[])
   verbose = 0;
   partition = -1;
   subpart = -1;
+  cacheBlocks = INODE_CACHE;
+  recursive = 0;
+  ordered = 1;
+  order = SORT_NONE;
+  threads = defaultWorkers();
+  stats = STATS_NONE;
+  sockPath = NULL;
 
   imageFile = NULL;
   path = NULL;
+  depth = 0;
   
   /*If the arguments are blatantly wrong, print usage and exit*/
   if(argc < 2)
@@ -194,18 +477,55 @@ int main(int argc, char *argv[])
   
   /*Argument parsing*/
   /*Argument parsing*/
-  while((i = getopt(argc, argv, "vp:s:")) != -1)
+  while((i = getopt_long(argc, argv, "vRUj:o:c:p:s:", longOptions,
+			 NULL)) != -1)
     switch(i)
     {
       case 'v':
 	      verbose = 1;
 	      break;
+      case 'R':
+	      recursive = 1;
+	      break;
+      case 'U':
+	      ordered = 0;
+	      break;
+      case 'j':
+	      threads = strtol(optarg, NULL, 10);
+	      if(threads <= 0)
+	        usage();
+	      break;
+      case 'o':
+	      if(strcmp(optarg, "name") == 0)
+	        order = SORT_NAME;
+	      else if(strcmp(optarg, "size") == 0)
+	        order = SORT_SIZE;
+	      else
+	        usage();
+	      break;
+      case 'c':
+	      cacheBlocks = strtol(optarg, NULL, 10);
+	      /*Need room for at least one block*/
+	      if(cacheBlocks <= 0)
+	        usage();
+	      break;
       case 'p':
 	      partition = strtol(optarg, NULL, 10);
 	      break;
       case 's':
 	      subpart = strtol(optarg, NULL, 10);
 	      break;
+      case OPT_STATS:
+	      if( (stats = statsFormat(optarg)) < 0 )
+	        usage();
+	      break;
+      case OPT_TRACE:
+	      if( startTrace(optarg) < 0 )
+	        exit(EXIT_FAILURE);
+	      break;
+      case OPT_DAEMON:
+	      sockPath = optarg;
+	      break;
       case '?':
 	      usage();
 	      break;
@@ -251,6 +571,24 @@ int main(int argc, char *argv[])
     }
   }
 
+  if(!imageFile)
+    usage();
+
+  /*minfsd has the image open already*/
+  if(sockPath)
+  {
+    if(recursive || verbose || stats)
+    {
+      fprintf(stderr, "-R, -v and --stats don't work with --daemon.\n");
+      exit(EXIT_FAILURE);
+    }
+
+    remoteList(sockPath, imageFile, partition, subpart, path, depth, order);
+    free(path);
+    free(imageFile);
+    return 0;
+  }
+
   /*Set up the access*/
   read = 'r';
   
@@ -262,7 +600,7 @@ int main(int argc, char *argv[])
   }
 
   /*Get the superblock and inode information*/
-  target = getSuper(image, partition, subpart);
+  target = getSuper(image, partition, subpart, ACCESS_MAP);
 
   /*If the target is null*/
   if(!target)
@@ -270,6 +608,10 @@ int main(int argc, char *argv[])
     fprintf(stderr, "This doesn't look like a minix file system.\n");
     exit(EXIT_FAILURE);
   }
+
+  /*Size the inode cache if asked to*/
+  if(cacheBlocks != INODE_CACHE)
+    setInodeCache(target, cacheBlocks);
   
   /*Find the correct folder in the file system, if path is provided*/
   if(path)
@@ -289,19 +631,42 @@ int main(int argc, char *argv[])
   else
   {
     /*Save root inode into target inode*/
-    target->inode = getInode(target, 1);
-
-    /*Save a string of its permissions*/
-    target->perms = getMode(target->inode->mode);
+    target->iNum = 1;
+    target->inode = getInode(target, 1, &target->inodeBuf);
 
-    /*If this is a folder, save the number of files in this directory*/
-    /*Root directories seem to have an extra file entry?*/
+    /*If this is a folder, save the number of entry slots in it*/
     target->numFiles = ISDIR(target->inode->mode) ?
-      (target->inode->size/DIR_SIZE) - 1 : 0;
+      (target->inode->size/DIR_SIZE) : 0;
+  }
+
+  /*Recursive listings of a directory go through the thread pool*/
+  if(recursive && ISDIR(target->inode->mode))
+  {
+    if(verbose)
+      printInfo(target);
+
+    /*Same path format as readDir*/
+    rootPath = malloc(2);
+    strcpy(rootPath, "/");
+    for(i = 0; i < depth; i++)
+    {
+      nextPath = childPath(rootPath, path[i]);
+      free(rootPath);
+      rootPath = nextPath;
+    }
+
+    target->numFiles = 0;
+    listTree(target, rootPath, ordered, order, threads);
+    if(stats)
+      printStats(target, stats);
+    cleanup(target, imageFile, path, depth);
+    return 0;
   }
 
   /*Get contents of the inode*/
   getContents(target);
+  if(target->files)
+    sortListing(target->files, order, target->mem);
 
   /*Output contents of superblock and inode if verbose*/
   if(verbose)
@@ -309,6 +674,10 @@ int main(int argc, char *argv[])
   
   /*Output file information*/
   readDir(target, path, depth);
+
+  /*Say what it took*/
+  if(stats)
+    printStats(target, stats);
   
   /*Clean up our mess*/
   cleanup(target, imageFile, path, depth);
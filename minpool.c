@@ -0,0 +1,255 @@
+/*This file contains a small work-stealing thread pool. Every worker has its
+ *own deque of tasks: it pushes and pops at the bottom of its own deque, and
+ *when it runs dry it steals from the top of someone else's. minls -R hands
+ *it directories, minget -r hands it directories and files.
+ */
+
+#include <pthread.h>
+#include "minfs.h"
+
+/*One worker's deque of tasks*/
+typedef struct work_deque
+{
+  pthread_mutex_t lock;
+  void **tasks; /*Circular buffer of tasks*/
+  int cap;      /*Room in tasks*/
+  long top;     /*Where thieves take from*/
+  long bottom;  /*Where the owner pushes and pops*/
+} *workDeque;
+
+struct work_pool
+{
+  int numWorkers;
+  struct work_deque *deques;
+  pthread_t *threads;
+  taskFn fn;              /*What to do with each task*/
+  void *arg;              /*Passed along to fn*/
+  long pending;           /*Tasks submitted but not finished yet*/
+  long queued;            /*Tasks sitting in a deque, not started yet*/
+  int stopping;           /*Set once everything is done*/
+  pthread_mutex_t lock;   /*Protects the counters and the condition*/
+  pthread_cond_t wake;    /*Signalled when there is work or we're done*/
+};
+
+/*Arguments for each worker thread*/
+typedef struct worker_arg
+{
+  pool p;
+  int id;
+} *workerArg;
+
+/*Pushes a task onto the bottom of a deque*/
+static void pushTask(workDeque deque, void *task)
+{
+  void **grown;
+  long i;
+
+  pthread_mutex_lock(&deque->lock);
+
+  /*Grow the buffer if it's full*/
+  if(deque->bottom - deque->top == deque->cap)
+  {
+    grown = malloc(sizeof(void *) * deque->cap * 2);
+    for(i = deque->top; i < deque->bottom; i++)
+      grown[i % (deque->cap * 2)] = deque->tasks[i % deque->cap];
+    free(deque->tasks);
+    deque->tasks = grown;
+    deque->cap *= 2;
+  }
+
+  deque->tasks[deque->bottom % deque->cap] = task;
+  deque->bottom++;
+
+  pthread_mutex_unlock(&deque->lock);
+}
+
+/*The owner takes its newest task*/
+static void *popTask(workDeque deque)
+{
+  void *task;
+
+  task = NULL;
+  pthread_mutex_lock(&deque->lock);
+
+  if(deque->bottom > deque->top)
+    task = deque->tasks[--deque->bottom % deque->cap];
+
+  pthread_mutex_unlock(&deque->lock);
+  return task;
+}
+
+/*A thief takes the oldest task*/
+static void *stealTask(workDeque deque)
+{
+  void *task;
+
+  task = NULL;
+  pthread_mutex_lock(&deque->lock);
+
+  if(deque->bottom > deque->top)
+    task = deque->tasks[deque->top++ % deque->cap];
+
+  pthread_mutex_unlock(&deque->lock);
+  return task;
+}
+
+/*Finds something to do: our own deque first, then everyone else's*/
+static void *findTask(pool p, int id)
+{
+  void *task;
+  int i;
+
+  task = popTask(&p->deques[id]);
+
+  for(i = 1; !task && i < p->numWorkers; i++)
+    task = stealTask(&p->deques[(id + i) % p->numWorkers]);
+
+  if(task)
+  {
+    pthread_mutex_lock(&p->lock);
+    p->queued--;
+    pthread_mutex_unlock(&p->lock);
+  }
+
+  return task;
+}
+
+/*What every worker thread runs until the pool is finished*/
+static void *worker(void *data)
+{
+  pool p;
+  int id;
+  void *task;
+
+  p = ((workerArg)data)->p;
+  id = ((workerArg)data)->id;
+  free(data);
+
+  while(1)
+  {
+    if( (task = findTask(p, id)) )
+    {
+      p->fn(p, id, task, p->arg);
+
+      /*Last task out wakes everyone up to leave*/
+      pthread_mutex_lock(&p->lock);
+      if(--p->pending == 0)
+      {
+	p->stopping = 1;
+	pthread_cond_broadcast(&p->wake);
+      }
+      pthread_mutex_unlock(&p->lock);
+      continue;
+    }
+
+    /*Nothing to steal, sleep until something is submitted or we're done*/
+    pthread_mutex_lock(&p->lock);
+    while(!p->stopping && p->queued == 0)
+      pthread_cond_wait(&p->wake, &p->lock);
+    if(p->stopping)
+    {
+      pthread_mutex_unlock(&p->lock);
+      break;
+    }
+    pthread_mutex_unlock(&p->lock);
+  }
+
+  return NULL;
+}
+
+/*Starts a pool with the given number of workers, each task is handed to fn
+ *along with arg*/
+pool makePool(int numWorkers, taskFn fn, void *arg)
+{
+  pool p;
+  workerArg wArg;
+  int i;
+
+  if(numWorkers < 1)
+    numWorkers = 1;
+
+  p = malloc(sizeof(struct work_pool));
+  p->numWorkers = numWorkers;
+  p->fn = fn;
+  p->arg = arg;
+  p->pending = 0;
+  p->queued = 0;
+  p->stopping = 0;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+
+  p->deques = malloc(sizeof(struct work_deque) * numWorkers);
+  for(i = 0; i < numWorkers; i++)
+  {
+    pthread_mutex_init(&p->deques[i].lock, NULL);
+    p->deques[i].cap = 64;
+    p->deques[i].tasks = malloc(sizeof(void *) * p->deques[i].cap);
+    p->deques[i].top = 0;
+    p->deques[i].bottom = 0;
+  }
+
+  p->threads = malloc(sizeof(pthread_t) * numWorkers);
+  for(i = 0; i < numWorkers; i++)
+  {
+    wArg = malloc(sizeof(struct worker_arg));
+    wArg->p = p;
+    wArg->id = i;
+
+    if( pthread_create(&p->threads[i], NULL, worker, wArg) != 0 )
+    {
+      perror("makePool - pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return p;
+}
+
+/*Adds a task to the pool. Workers pass their own id so the task lands on
+ *their deque, anyone else passes -1.*/
+void poolSubmit(pool p, int id, void *task)
+{
+  /*Counted as pending before anyone can pick it up and finish it*/
+  pthread_mutex_lock(&p->lock);
+  p->pending++;
+  pthread_mutex_unlock(&p->lock);
+
+  pushTask(&p->deques[id < 0 ? 0 : id], task);
+
+  /*Let a sleeping worker know there's something to steal*/
+  pthread_mutex_lock(&p->lock);
+  p->queued++;
+  pthread_cond_signal(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/*Waits for every task (including ones submitted by tasks) to finish, then
+ *shuts the pool down. Something has to have been submitted first.*/
+void finishPool(pool p)
+{
+  int i;
+
+  for(i = 0; i < p->numWorkers; i++)
+    pthread_join(p->threads[i], NULL);
+
+  for(i = 0; i < p->numWorkers; i++)
+  {
+    pthread_mutex_destroy(&p->deques[i].lock);
+    free(p->deques[i].tasks);
+  }
+
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->wake);
+  free(p->deques);
+  free(p->threads);
+  free(p);
+}
+
+/*Number of worker threads to use when nobody says otherwise*/
+int defaultWorkers(void)
+{
+  long cpus;
+
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? cpus : 1;
+}
@@ -0,0 +1,310 @@
+/*This file contains the protocol minfsd and its clients (minls and minget
+ *with --daemon) talk over a Unix domain socket. Everything is sent as
+ *frames: a 32-bit length in host order (both ends are on the same machine)
+ *followed by that many bytes. A request is one frame, a struct
+ *daemon_request followed by the image path and the path in the image, each
+ *nul-terminated. The answer starts with a frame holding a struct
+ *daemon_reply (and an error message if status isn't 0), then:
+ *    DAEMON_LIST  one frame per column of the listing (inodes, modes, sizes,
+ *                 nameOff, names) if the path is a directory
+ *    DAEMON_STAT  nothing else
+ *    DAEMON_READ  the file a run of zones at a time, unframed: a struct
+ *                 daemon_run, then that many bytes unless the run is a
+ *                 hole, until inode.size bytes are accounted for
+ */
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "minfs.h"
+
+/*Sends all len bytes. Returns -1 if the other end has gone away, which
+ *isn't worth a SIGPIPE.*/
+int sendAll(int sock, void *data, long len)
+{
+  ssize_t sent;
+
+  while(len > 0)
+  {
+    sent = send(sock, data, len, MSG_NOSIGNAL);
+
+    if(sent < 0 && errno == EINTR)
+      continue;
+    if(sent <= 0)
+      return -1;
+
+    data = (char *)data + sent;
+    len -= sent;
+  }
+
+  return 0;
+}
+
+/*Receives exactly len bytes. Returns -1 on an error or if the other end
+ *closed the connection first.*/
+int recvAll(int sock, void *data, long len)
+{
+  ssize_t got;
+
+  while(len > 0)
+  {
+    got = recv(sock, data, len, 0);
+
+    if(got < 0 && errno == EINTR)
+      continue;
+    if(got <= 0)
+      return -1;
+
+    data = (char *)data + got;
+    len -= got;
+  }
+
+  return 0;
+}
+
+/*Sends len bytes as one frame*/
+int sendFrame(int sock, void *data, uint32_t len)
+{
+  if( sendAll(sock, &len, sizeof(uint32_t)) < 0 )
+    return -1;
+
+  return sendAll(sock, data, len);
+}
+
+/*Receives one frame into memory from mem, with a nul-byte after it so
+ *strings in it are safe to use. Returns NULL if the connection ended or
+ *the frame is unreasonably big.*/
+void *recvFrame(int sock, uint32_t *len, arena mem)
+{
+  char *data;
+
+  if( recvAll(sock, len, sizeof(uint32_t)) < 0 || *len > DAEMON_MAX_FRAME )
+    return NULL;
+
+  data = arenaAlloc(mem, *len + 1);
+  if( recvAll(sock, data, *len) < 0 )
+    return NULL;
+  data[*len] = '\0';
+
+  return data;
+}
+
+/*Fills in the address of the socket at path. Returns -1 if the path is too
+ *long to be one.*/
+static int socketAddress(char *path, struct sockaddr_un *addr)
+{
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+
+  if(strlen(path) >= sizeof(addr->sun_path))
+  {
+    fprintf(stderr, "%s - socket path too long\n", path);
+    return -1;
+  }
+
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+/*Creates the socket at path (replacing a stale one) and starts listening.
+ *Returns -1 on failure.*/
+int daemonListen(char *path)
+{
+  struct sockaddr_un addr;
+  int sock;
+
+  if( socketAddress(path, &addr) < 0 )
+    return -1;
+
+  if( (sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 )
+  {
+    perror("daemonListen - socket");
+    return -1;
+  }
+
+  unlink(path);
+
+  if( bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sock, SOMAXCONN) < 0 )
+  {
+    perror(path);
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+/*Connects to minfsd at path and asks it for op on path in the given image
+ *and partition. The reply is copied into reply. Returns the connection to
+ *read the rest of the answer from, or -1 (having said why) if it couldn't
+ *be asked or said no.*/
+int daemonAsk(char *sockPath, int op, char *image, int part, int subpart,
+	      char *path, daemonReply reply, arena mem)
+{
+  struct sockaddr_un addr;
+  struct daemon_request request;
+  char *frame;
+  uint32_t len;
+  long imageLen, pathLen;
+  int sock;
+
+  if( socketAddress(sockPath, &addr) < 0 )
+    return -1;
+
+  if( (sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+      connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 )
+  {
+    perror(sockPath);
+    if(sock >= 0)
+      close(sock);
+    return -1;
+  }
+
+  /*The request and both paths go in one frame*/
+  request.op = op;
+  request.part = part;
+  request.subpart = subpart;
+  imageLen = strlen(image) + 1;
+  pathLen = strlen(path) + 1;
+
+  frame = arenaAlloc(mem, sizeof(request) + imageLen + pathLen);
+  memcpy(frame, &request, sizeof(request));
+  memcpy(frame + sizeof(request), image, imageLen);
+  memcpy(frame + sizeof(request) + imageLen, path, pathLen);
+
+  if( sendFrame(sock, frame, sizeof(request) + imageLen + pathLen) < 0 ||
+      !(frame = recvFrame(sock, &len, mem)) ||
+      len < sizeof(struct daemon_reply) )
+  {
+    fprintf(stderr, "%s - no answer from minfsd\n", sockPath);
+    close(sock);
+    return -1;
+  }
+
+  memcpy(reply, frame, sizeof(struct daemon_reply));
+
+  /*minfsd says what went wrong after the reply*/
+  if(reply->status != 0)
+  {
+    fprintf(stderr, "%s\n", frame + sizeof(struct daemon_reply));
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+/*Puts a path split up by a tool back together for a request*/
+char *daemonPath(char **path, int depth, arena mem)
+{
+  char *joined;
+  long len;
+  int i;
+
+  len = 2;
+  for(i = 0; i < depth; i++)
+    len += strlen(path[i]) + 1;
+
+  joined = arenaAlloc(mem, len);
+  strcpy(joined, "/");
+  for(i = 0; i < depth; i++)
+  {
+    if(i > 0)
+      strcat(joined, "/");
+    strcat(joined, path[i]);
+  }
+
+  return joined;
+}
+
+/*Receives the listing that follows a DAEMON_LIST reply for a directory,
+ *into mem. Returns NULL if it doesn't all arrive.*/
+dirList recvListing(int sock, daemonReply reply, arena mem)
+{
+  dirList list;
+  uint32_t len;
+
+  list = arenaAlloc(mem, sizeof(struct dir_listing));
+  list->count = reply->count;
+
+  if( !(list->inodes = recvFrame(sock, &len, mem)) ||
+      len != sizeof(uint32_t) * reply->count ||
+      !(list->modes = recvFrame(sock, &len, mem)) ||
+      len != sizeof(uint16_t) * reply->count ||
+      !(list->sizes = recvFrame(sock, &len, mem)) ||
+      len != sizeof(uint32_t) * reply->count ||
+      !(list->nameOff = recvFrame(sock, &len, mem)) ||
+      len != sizeof(uint32_t) * reply->count ||
+      !(list->names = recvFrame(sock, &len, mem)) )
+  {
+    fprintf(stderr, "minfsd - listing cut short\n");
+    return NULL;
+  }
+
+  return list;
+}
+
+/*Copies the contents that follow a DAEMON_READ reply to destination. Holes
+ *are skipped over the way readFile does, so a regular file stays sparse.
+ *Returns -1 if they don't all arrive.*/
+int recvContents(int sock, daemonReply reply, FILE *destination)
+{
+  char buffer[ZERO_PAGE * 16];
+  struct daemon_run piece;
+  struct stat info;
+  long left, runLeft;
+  ssize_t got;
+  int isFile, holeLast;
+
+  isFile = fstat(fileno(destination), &info) == 0 && S_ISREG(info.st_mode);
+  holeLast = 0;
+
+  for(left = reply->inode.size; left > 0; left -= piece.len)
+  {
+    if( recvAll(sock, &piece, sizeof(piece)) < 0 || piece.len == 0 ||
+	piece.len > left )
+    {
+      fprintf(stderr, "minfsd - file cut short\n");
+      return -1;
+    }
+
+    holeLast = piece.hole;
+    if(piece.hole)
+    {
+      skipHole(destination, isFile, piece.len);
+      continue;
+    }
+
+    for(runLeft = piece.len; runLeft > 0; runLeft -= got)
+    {
+      got = recv(sock, buffer, runLeft < sizeof(buffer) ? runLeft :
+		 sizeof(buffer), 0);
+
+      if(got < 0 && errno == EINTR)
+      {
+	got = 0;
+	continue;
+      }
+
+      if(got <= 0)
+      {
+	fprintf(stderr, "minfsd - file cut short\n");
+	return -1;
+      }
+
+      if( fwrite(buffer, sizeof(char), got, destination) != got )
+      {
+	perror("recvContents - fwrite");
+	return -1;
+      }
+    }
+  }
+
+  /*A hole at the end was only seeked over*/
+  if(holeLast && isFile)
+    sizeForHole(destination);
+
+  return 0;
+}
@@ -0,0 +1,141 @@
+/*This file contains the phase tracer. While a trace is open, the major
+ *steps (finding the partition, loading the superblock, each path component,
+ *each directory scan, each extent copied) are timed and written out as
+ *Chrome trace events, which chrome://tracing or Perfetto can load. When no
+ *trace is open, traceStart is one test and the spans cost nothing else.
+ */
+
+/*For gettid*/
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <time.h>
+#include "minfs.h"
+
+/*Where events go, NULL when not tracing*/
+static FILE *traceFile = NULL;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static double traceEpoch;  /*When the trace was started (us)*/
+static int traceEvents;    /*Events written so far*/
+
+/*Monotonic time in us*/
+static double traceNow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*Writes a string as a JSON string, at most max bytes of it*/
+static void traceString(char *string, int max)
+{
+  int i;
+
+  putc('"', traceFile);
+  for(i = 0; i < max && string[i]; i++)
+  {
+    if(string[i] == '"' || string[i] == '\\')
+      putc('\\', traceFile);
+
+    /*Control characters would make the JSON invalid*/
+    if((unsigned char)string[i] < ' ')
+      fprintf(traceFile, "\\u%04x", (unsigned char)string[i]);
+    else
+      putc(string[i], traceFile);
+  }
+  putc('"', traceFile);
+}
+
+/*Starts writing a trace to the given file. The trace is finished when the
+ *program exits, even if that's on an error. Returns -1 if the file can't
+ *be opened.*/
+int startTrace(char *file)
+{
+  if( !(traceFile = fopen(file, "w")) )
+  {
+    perror(file);
+    return -1;
+  }
+
+  traceEpoch = traceNow();
+  traceEvents = 0;
+  fprintf(traceFile, "{\"traceEvents\":[\n");
+  atexit(stopTrace);
+
+  return 0;
+}
+
+/*Finishes the trace file, if there is one*/
+void stopTrace(void)
+{
+  pthread_mutex_lock(&traceLock);
+
+  if(traceFile)
+  {
+    fprintf(traceFile, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(traceFile);
+    traceFile = NULL;
+  }
+
+  pthread_mutex_unlock(&traceLock);
+}
+
+/*Returns the start time of a span, or 0 if nothing is being traced*/
+double traceStart(void)
+{
+  if(!traceFile)
+    return 0;
+
+  return traceNow();
+}
+
+/*Ends a span that started at start (from traceStart), on the calling
+ *thread. label is an optional string argument (a file name, say) and fmt
+ *formats any other arguments, which have to be JSON members already.*/
+void traceSpan(double start, char *name, char *label, char *fmt, ...)
+{
+  va_list args;
+  double end;
+  int first;
+
+  if(start == 0)
+    return;
+
+  end = traceNow();
+
+  pthread_mutex_lock(&traceLock);
+
+  /*The trace may have been stopped since the span started*/
+  if(!traceFile)
+  {
+    pthread_mutex_unlock(&traceLock);
+    return;
+  }
+
+  fprintf(traceFile, "%s{\"name\":\"%s\",\"cat\":\"minfs\",\"ph\":\"X\","
+	  "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{",
+	  traceEvents++ ? ",\n" : "", name, start - traceEpoch, end - start,
+	  (int)getpid(), (int)gettid());
+
+  first = 1;
+  if(label)
+  {
+    fprintf(traceFile, "\"label\":");
+    traceString(label, 60);
+    first = 0;
+  }
+
+  if(fmt)
+  {
+    if(!first)
+      putc(',', traceFile);
+    va_start(args, fmt);
+    vfprintf(traceFile, fmt, args);
+    va_end(args);
+  }
+
+  fprintf(traceFile, "}}");
+
+  pthread_mutex_unlock(&traceLock);
+}
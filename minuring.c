@@ -0,0 +1,537 @@
+/*This file contains the io_uring extraction engine. Instead of copying a
+ *file one chunk at a time and waiting on each, every chunk of every file
+ *handed to a ring is queued, and up to a ring's worth of reads and writes
+ *are in flight at once, across as many files as it takes to fill it. When
+ *the image is in memory each chunk is one write straight out of it;
+ *otherwise it is a read into one of the ring's registered buffers linked to
+ *a write out of that buffer. io_uring is driven with the raw system calls,
+ *and makeUring returns NULL when the kernel doesn't have it, so callers can
+ *fall back to writeFile.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "minfs.h"
+
+/*A file being copied. It is sized and closed once its last write lands.*/
+typedef struct uring_file
+{
+  int destFd;      /*Where it goes, the ring closes it*/
+  long size;       /*How big it ends up*/
+  int inFlight;    /*Reads and writes not completed yet*/
+  int queued;      /*1 once every chunk of it has been queued*/
+} *uringFile;
+
+/*One read or write in flight*/
+typedef struct uring_op
+{
+  uringFile file;         /*File it is for*/
+  int buf;                /*Registered buffer it uses, -1 for none*/
+  int write;              /*1 for the write to the destination*/
+  long len;               /*Bytes it should move*/
+  long destOff;           /*Where in the destination (writes)*/
+  char *data;             /*What is being written (writes)*/
+  struct uring_op *next;  /*Next free op*/
+} *uringOp;
+
+struct uring_ring
+{
+  int fd;                   /*The ring itself*/
+  tools target;             /*File system everything is read from*/
+  long chunk;               /*Largest single read or write (bytes)*/
+
+  /*Submission queue*/
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned sqEntries;
+  struct io_uring_sqe *sqes;
+  unsigned toSubmit;        /*Queued but not handed to the kernel yet*/
+
+  /*Completion queue*/
+  unsigned *cqHead, *cqTail, *cqMask;
+  unsigned cqEntries;
+  struct io_uring_cqe *cqes;
+  unsigned inFlight;        /*Handed to the kernel, not completed yet*/
+
+  /*Mappings, to undo them*/
+  void *sqMap, *cqMap;
+  size_t sqMapLen, cqMapLen, sqesLen;
+
+  /*Buffers reads land in, only when the image isn't in memory*/
+  int numBufs;
+  int fixed;                /*1 if they are registered with the kernel*/
+  char **bufs;
+  int *freeBufs;            /*Stack of buffers not in use*/
+  int numFree;
+
+  struct uring_op *ops;     /*One for every completion there's room for*/
+  uringOp freeOps;
+};
+
+static int uringSetup(unsigned entries, struct io_uring_params *params)
+{
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete,
+		      unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+		 NULL, 0);
+}
+
+static int uringRegister(int fd, unsigned opcode, void *arg, unsigned num)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, num);
+}
+
+/*Returns 1 if the kernel behind the ring can do every opcode uringChunk
+ *queues. Plain READ and WRITE only arrived in 5.6, along with the probe
+ *itself, so a ring from an older kernel fails the register and says no.*/
+static int uringProbe(int fd)
+{
+  static const int needed[] = {IORING_OP_READ, IORING_OP_WRITE,
+			       IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED};
+  struct io_uring_probe *probe;
+  int i, ok;
+
+  probe = calloc(1, sizeof(struct io_uring_probe) +
+		 256 * sizeof(struct io_uring_probe_op));
+  ok = uringRegister(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+  for(i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++)
+    ok = needed[i] <= probe->last_op &&
+      (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+
+  free(probe);
+  return ok;
+}
+
+/*Sets up a ring with depth submission slots for copying files out of the
+ *given file system (at least 2, a read and the write linked to it).
+ *Returns NULL (having changed nothing) if io_uring isn't available here,
+ *the kernel lacks the reads and writes it needs, or the image is
+ *compressed.*/
+uring makeUring(tools target, int depth)
+{
+  struct io_uring_params params;
+  struct iovec *iov;
+  uring ring;
+  int fd, i;
+
+  /*Compressed images can't be read straight into a buffer*/
+  if(target->map->zimg)
+    return NULL;
+
+  /*Anything less could never fit a read and its write, or a buffer*/
+  if(depth < 2)
+    depth = 2;
+
+  memset(&params, 0, sizeof(params));
+  if( (fd = uringSetup(depth, &params)) < 0 )
+    return NULL;
+
+  if( !uringProbe(fd) )
+  {
+    close(fd);
+    return NULL;
+  }
+
+  ring = calloc(1, sizeof(struct uring_ring));
+  ring->fd = fd;
+  ring->target = target;
+  ring->chunk = target->maxIO;
+  ring->sqEntries = params.sq_entries;
+  ring->cqEntries = params.cq_entries;
+
+  /*Map the two queues and the submission entries*/
+  ring->sqMapLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqMapLen = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sqMap = mmap(NULL, ring->sqMapLen, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->cqMap = mmap(NULL, ring->cqMapLen, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+  if(ring->sqMap == MAP_FAILED || ring->cqMap == MAP_FAILED ||
+     ring->sqes == MAP_FAILED)
+  {
+    if(ring->sqMap != MAP_FAILED)
+      munmap(ring->sqMap, ring->sqMapLen);
+    if(ring->cqMap != MAP_FAILED)
+      munmap(ring->cqMap, ring->cqMapLen);
+    if(ring->sqes != MAP_FAILED)
+      munmap(ring->sqes, ring->sqesLen);
+    close(fd);
+    free(ring);
+    return NULL;
+  }
+
+  ring->sqHead = (unsigned *)((char *)ring->sqMap + params.sq_off.head);
+  ring->sqTail = (unsigned *)((char *)ring->sqMap + params.sq_off.tail);
+  ring->sqMask = (unsigned *)((char *)ring->sqMap + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned *)((char *)ring->sqMap + params.sq_off.array);
+  ring->cqHead = (unsigned *)((char *)ring->cqMap + params.cq_off.head);
+  ring->cqTail = (unsigned *)((char *)ring->cqMap + params.cq_off.tail);
+  ring->cqMask = (unsigned *)((char *)ring->cqMap + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cqMap +
+				       params.cq_off.cqes);
+
+  /*Every op ends in a completion, so there can't be more of them than the
+   *completion queue holds*/
+  ring->ops = malloc(sizeof(struct uring_op) * ring->cqEntries);
+  for(i = 0; i < ring->cqEntries; i++)
+  {
+    ring->ops[i].next = ring->freeOps;
+    ring->freeOps = &ring->ops[i];
+  }
+
+  /*Reads need somewhere to go if the image isn't in memory. Registering
+   *them saves pinning them on every read, but it's only an optimization.*/
+  if(!target->map->direct)
+  {
+    ring->numBufs = depth / 2 < URING_BUFS ? depth / 2 : URING_BUFS;
+    if(ring->numBufs < 1)
+      ring->numBufs = 1;
+
+    ring->bufs = malloc(sizeof(char *) * ring->numBufs);
+    ring->freeBufs = malloc(sizeof(int) * ring->numBufs);
+    iov = malloc(sizeof(struct iovec) * ring->numBufs);
+
+    for(i = 0; i < ring->numBufs; i++)
+    {
+      ring->bufs[i] = malloc(ring->chunk);
+      ring->freeBufs[i] = i;
+      iov[i].iov_base = ring->bufs[i];
+      iov[i].iov_len = ring->chunk;
+    }
+    ring->numFree = ring->numBufs;
+
+    ring->fixed = uringRegister(fd, IORING_REGISTER_BUFFERS, iov,
+				ring->numBufs) == 0;
+    free(iov);
+  }
+
+  return ring;
+}
+
+/*Hands everything queued so far to the kernel, and waits for at least
+ *minComplete of the ops in flight to finish*/
+static void uringSubmit(uring ring, unsigned minComplete)
+{
+  int done;
+
+  while(ring->toSubmit > 0 || minComplete > 0)
+  {
+    done = uringEnter(ring->fd, ring->toSubmit, minComplete,
+		      minComplete ? IORING_ENTER_GETEVENTS : 0);
+
+    if(done < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+      continue;
+    if(done < 0)
+    {
+      perror("uringSubmit - io_uring_enter");
+      exit(EXIT_FAILURE);
+    }
+
+    ring->toSubmit -= done;
+    ring->inFlight += done;
+    minComplete = 0;
+  }
+}
+
+/*Sizes and closes a file once nothing of it is left in flight*/
+static void finishFile(uringFile file)
+{
+  if(file->inFlight > 0 || !file->queued)
+    return;
+
+  /*Holes were never written, so the size has to be set*/
+  if( ftruncate(file->destFd, file->size) < 0 )
+    perror("uring - ftruncate");
+  if( close(file->destFd) < 0 )
+    perror("uring - close");
+  free(file);
+}
+
+/*Writes whatever a short write left out, the slow way*/
+static void finishWrite(uringOp op, long written)
+{
+  ssize_t got;
+
+  while(written < op->len)
+  {
+    got = pwrite(op->file->destFd, op->data + written, op->len - written,
+		 op->destOff + written);
+
+    if(got < 0 && errno == EINTR)
+      continue;
+    if(got <= 0)
+    {
+      perror("uring - pwrite");
+      exit(EXIT_FAILURE);
+    }
+
+    written += got;
+  }
+}
+
+/*Deals with every completion that has arrived*/
+static void uringReap(uring ring)
+{
+  struct io_uring_cqe *cqe;
+  unsigned head, tail;
+  uringOp op;
+
+  head = *ring->cqHead;
+  tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+  for(; head != tail; head++)
+  {
+    cqe = &ring->cqes[head & *ring->cqMask];
+    op = (uringOp)(uintptr_t)cqe->user_data;
+    ring->inFlight--;
+
+    /*Reads never come up short, the range was checked against the image
+     *before it was queued. A failed read cancels its write.*/
+    if(!op->write && cqe->res != op->len)
+    {
+      fprintf(stderr, "uring - read: %s\n",
+	      cqe->res < 0 ? strerror(-cqe->res) : "short read");
+      exit(EXIT_FAILURE);
+    }
+
+    if(op->write)
+    {
+      if(cqe->res < 0)
+      {
+	fprintf(stderr, "uring - write: %s\n", strerror(-cqe->res));
+	exit(EXIT_FAILURE);
+      }
+      finishWrite(op, cqe->res);
+
+      /*The buffer can take another read now*/
+      if(op->buf >= 0)
+	ring->freeBufs[ring->numFree++] = op->buf;
+    }
+
+    op->file->inFlight--;
+    finishFile(op->file);
+
+    op->next = ring->freeOps;
+    ring->freeOps = op;
+  }
+
+  __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/*Waits until there is room for count more ops (and a buffer, if one is
+ *needed)*/
+static void uringRoom(uring ring, unsigned count, int needBuf)
+{
+  unsigned queued;
+
+  /*Otherwise this would wait forever*/
+  assert(count <= ring->sqEntries && count <= ring->cqEntries &&
+	 (!needBuf || ring->numBufs > 0));
+
+  while(1)
+  {
+    uringReap(ring);
+
+    queued = ring->toSubmit + ring->inFlight;
+    if(queued + count <= ring->cqEntries &&
+       ring->toSubmit + count <= ring->sqEntries &&
+       (!needBuf || ring->numFree > 0))
+      return;
+
+    /*Nothing can free up until what's queued is in the kernel's hands*/
+    uringSubmit(ring, ring->inFlight + ring->toSubmit > 0 ? 1 : 0);
+  }
+}
+
+/*Takes the next submission entry and an op to go with it*/
+static struct io_uring_sqe *uringQueue(uring ring, uringFile file, int write,
+				       int buf, long len, uringOp *opOut)
+{
+  struct io_uring_sqe *sqe;
+  unsigned tail;
+  uringOp op;
+
+  op = ring->freeOps;
+  ring->freeOps = op->next;
+  op->file = file;
+  op->write = write;
+  op->buf = buf;
+  op->len = len;
+  file->inFlight++;
+
+  tail = *ring->sqTail;
+  sqe = &ring->sqes[tail & *ring->sqMask];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->user_data = (uintptr_t)op;
+  ring->sqArray[tail & *ring->sqMask] = tail & *ring->sqMask;
+  __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+  ring->toSubmit++;
+
+  *opOut = op;
+  return sqe;
+}
+
+/*Queues one chunk: a write straight out of the image if it's in memory,
+ *otherwise a read into a buffer linked to a write out of it*/
+static void uringChunk(uring ring, uringFile file, long imgOff, long destOff,
+		       long len)
+{
+  struct io_uring_sqe *sqe;
+  imgMap map;
+  uringOp op;
+  int buf;
+
+  map = ring->target->map;
+
+  /*Same check imgRead does*/
+  if(imgOff < 0 || imgOff > map->size - len)
+  {
+    fprintf(stderr, "uring - read past end of image (offset %ld)\n", imgOff);
+    exit(EXIT_FAILURE);
+  }
+  countRead(map, IO_DATA, imgOff, len);
+
+  if(map->direct)
+  {
+    uringRoom(ring, 1, 0);
+    sqe = uringQueue(ring, file, 1, -1, len, &op);
+    op->data = (char *)map->data + imgOff;
+    op->destOff = destOff;
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = file->destFd;
+    sqe->addr = (uintptr_t)op->data;
+    sqe->len = len;
+    sqe->off = destOff;
+    return;
+  }
+
+  uringRoom(ring, 2, 1);
+  buf = ring->freeBufs[--ring->numFree];
+  __atomic_add_fetch(&map->preads, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&map->io[IO_DATA].preads, 1, __ATOMIC_RELAXED);
+
+  /*The write mustn't start until the read is done*/
+  sqe = uringQueue(ring, file, 0, buf, len, &op);
+  sqe->opcode = ring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->fd = map->fd;
+  sqe->addr = (uintptr_t)ring->bufs[buf];
+  sqe->len = len;
+  sqe->off = imgOff;
+  sqe->buf_index = buf;
+
+  sqe = uringQueue(ring, file, 1, buf, len, &op);
+  op->data = ring->bufs[buf];
+  op->destOff = destOff;
+  sqe->opcode = ring->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->fd = file->destFd;
+  sqe->addr = (uintptr_t)op->data;
+  sqe->len = len;
+  sqe->off = destOff;
+  sqe->buf_index = buf;
+}
+
+/*Queues every chunk of the file to be written to destFd (a regular file)
+ *and returns without waiting for them. The ring owns destFd from here on:
+ *it sizes the file and closes it once the last write lands, which may be
+ *during a later call or in uringDrain.*/
+void uringCopy(uring ring, inode file, int destFd)
+{
+  long runOff, runBytes, left, toWrite;
+  uringFile dest;
+  tools target;
+  extMap map;
+  extent run;
+  int i;
+
+  target = ring->target;
+  map = getExtents(target, file, NULL);
+
+  dest = malloc(sizeof(struct uring_file));
+  dest->destFd = destFd;
+  dest->size = file->size;
+  dest->inFlight = 0;
+  dest->queued = 0;
+
+  for(i = 0; i < map->numRuns; i++)
+  {
+    run = &map->runs[i];
+
+    /*Holes are left alone, the size is set at the end*/
+    if(run->hole)
+      continue;
+
+    /*The run might go past the end of the file (partial last zone)*/
+    left = file->size - (long)run->logical * target->zonesize;
+    runBytes = (long)run->len * target->zonesize;
+    if(runBytes > left)
+      runBytes = left;
+
+    for(runOff = 0; runOff < runBytes; runOff += toWrite)
+    {
+      toWrite = runBytes - runOff;
+      if(toWrite > ring->chunk)
+	toWrite = ring->chunk;
+
+      uringChunk(ring, dest,
+		 target->offset + (long)run->start * target->zonesize + runOff,
+		 (long)run->logical * target->zonesize + runOff, toWrite);
+    }
+  }
+
+  freeExtents(map);
+
+  /*Get it going, then see if it's already all done*/
+  dest->queued = 1;
+  uringSubmit(ring, 0);
+  finishFile(dest);
+}
+
+/*Waits for everything queued on the ring to finish*/
+void uringDrain(uring ring)
+{
+  uringSubmit(ring, 0);
+
+  while(ring->inFlight > 0)
+  {
+    uringSubmit(ring, 1);
+    uringReap(ring);
+  }
+}
+
+/*Finishes everything on the ring and tears it down*/
+void freeUring(uring ring)
+{
+  int i;
+
+  if(!ring)
+    return;
+
+  uringDrain(ring);
+
+  for(i = 0; i < ring->numBufs; i++)
+    free(ring->bufs[i]);
+  free(ring->bufs);
+  free(ring->freeBufs);
+  free(ring->ops);
+
+  munmap(ring->sqes, ring->sqesLen);
+  munmap(ring->cqMap, ring->cqMapLen);
+  munmap(ring->sqMap, ring->sqMapLen);
+  close(ring->fd);
+  free(ring);
+}
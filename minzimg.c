@@ -0,0 +1,307 @@
+/*This file contains the reader for compressed images (made by minzip).
+ *The image is kept compressed on disk and only the chunks something reads
+ *get decompressed, so listing a directory costs the chunks its inode,
+ *zones and the inode table blocks in question live in, not the whole
+ *image. Decompressed chunks are kept in a small cache shared by every
+ *thread, and the least recently used one is dropped when it fills up.
+ */
+
+#include <errno.h>
+#include <zlib.h>
+#include "minfs.h"
+
+/*Reads exactly len bytes at offset in the compressed file. Returns -1 on
+ *failure or if the file ends first.*/
+static int preadAll(int fd, void *data, long len, long offset)
+{
+  ssize_t got;
+
+  while(len > 0)
+  {
+    got = pread(fd, data, len, offset);
+
+    if(got < 0 && errno == EINTR)
+      continue;
+    if(got <= 0)
+      return -1;
+
+    data = (char *)data + got;
+    offset += got;
+    len -= got;
+  }
+
+  return 0;
+}
+
+/*Checks whether fd is a compressed image and, if it is, reads its index
+ *and sets up an empty chunk cache. Returns NULL for anything else.*/
+zimgCache openZimg(int fd)
+{
+  struct zimg_trailer trailer;
+  zimgCache zimg;
+  off_t end;
+  uint64_t entries, room;
+  uint32_t i;
+
+  if( (end = lseek(fd, 0, SEEK_END)) < (off_t)sizeof(trailer) ||
+      preadAll(fd, &trailer, sizeof(trailer), end - sizeof(trailer)) < 0 ||
+      trailer.magic != ZIMG_MAGIC )
+    return NULL;
+
+  /*Offsets of every chunk plus the end of the last one, in 64 bits so a
+   *count of UINT32_MAX can't wrap, and everything the index needs has to
+   *be in the file before any of it is allocated*/
+  entries = (uint64_t)trailer.numChunks + 1;
+  room = end - sizeof(trailer);
+
+  /*It says it is one, so anything wrong with it now is an error*/
+  if(trailer.version != ZIMG_VERSION || trailer.chunkSize == 0 ||
+     trailer.numChunks != trailer.size / trailer.chunkSize +
+     (trailer.size % trailer.chunkSize != 0) ||
+     trailer.indexOff > room ||
+     entries > (room - trailer.indexOff) / sizeof(uint64_t))
+  {
+    fprintf(stderr, "openImage - compressed image is damaged\n");
+    imgFail();
+  }
+
+  if( !(zimg = calloc(1, sizeof(struct zimg_cache))) )
+  {
+    perror("openImage - malloc");
+    imgFail();
+  }
+  pthread_mutex_init(&zimg->lock, NULL);
+
+  /*slotOf gets a spare entry too, so an empty image doesn't malloc 0*/
+  if( !(zimg->index = malloc(entries * sizeof(uint64_t))) ||
+      !(zimg->slotOf = malloc(entries * sizeof(int))) ||
+      !(zimg->slots = malloc(ZIMG_CACHE * sizeof(struct zimg_slot))) )
+  {
+    perror("openImage - malloc");
+    closeZimg(zimg);
+    imgFail();
+  }
+
+  zimg->size = trailer.size;
+  zimg->chunkSize = trailer.chunkSize;
+  zimg->numChunks = trailer.numChunks;
+
+  if( preadAll(fd, zimg->index, entries * sizeof(uint64_t),
+	       trailer.indexOff) < 0 )
+  {
+    perror("openImage - compressed image index");
+    closeZimg(zimg);
+    imgFail();
+  }
+
+  /*Chunks have to be in order and inside the file*/
+  for(i = 0; i < zimg->numChunks; i++)
+    if(zimg->index[i] > zimg->index[i + 1] ||
+       zimg->index[i + 1] - zimg->index[i] > compressBound(zimg->chunkSize))
+      break;
+
+  if(i < zimg->numChunks || zimg->index[zimg->numChunks] > trailer.indexOff)
+  {
+    fprintf(stderr, "openImage - compressed image is damaged\n");
+    closeZimg(zimg);
+    imgFail();
+  }
+
+  for(i = 0; i < zimg->numChunks; i++)
+    zimg->slotOf[i] = -1;
+
+  zimg->numSlots = ZIMG_CACHE;
+  for(i = 0; i < zimg->numSlots; i++)
+  {
+    zimg->slots[i].chunk = -1;
+    zimg->slots[i].lastUse = 0;
+    zimg->slots[i].data = NULL;
+  }
+
+  zimg->clock = 0;
+  zimg->hits = 0;
+  zimg->misses = 0;
+
+  return zimg;
+}
+
+/*Frees the index and every cached chunk*/
+void closeZimg(zimgCache zimg)
+{
+  int i;
+
+  if(!zimg)
+    return;
+
+  for(i = 0; i < zimg->numSlots; i++)
+    free(zimg->slots[i].data);
+
+  pthread_mutex_destroy(&zimg->lock);
+  free(zimg->slots);
+  free(zimg->slotOf);
+  free(zimg->index);
+  free(zimg);
+}
+
+/*Bytes of image in the given chunk (the last one may be short)*/
+static long chunkLen(imgMap map, long chunk)
+{
+  long start;
+
+  start = chunk * (long)map->zimg->chunkSize;
+  return map->zimg->size - start < map->zimg->chunkSize ?
+    map->zimg->size - start : map->zimg->chunkSize;
+}
+
+/*Reads and decompresses one chunk into a new buffer*/
+static unsigned char *loadChunk(imgMap map, long chunk, int caller)
+{
+  unsigned char *packed, *data;
+  long packedLen, len;
+  uLongf outLen;
+  zimgCache zimg;
+
+  zimg = map->zimg;
+  len = chunkLen(map, chunk);
+  packedLen = zimg->index[chunk + 1] - zimg->index[chunk];
+  data = malloc(zimg->chunkSize);
+
+  __atomic_add_fetch(&map->preads, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&map->io[caller].preads, 1, __ATOMIC_RELAXED);
+
+  /*Chunks that didn't compress were stored as they are*/
+  if(packedLen == len)
+  {
+    if( preadAll(map->fd, data, len, zimg->index[chunk]) < 0 )
+    {
+      perror(ioName(caller));
+      free(data);
+      imgFail();
+    }
+    return data;
+  }
+
+  packed = malloc(packedLen);
+  if( preadAll(map->fd, packed, packedLen, zimg->index[chunk]) < 0 )
+  {
+    perror(ioName(caller));
+    free(packed);
+    free(data);
+    imgFail();
+  }
+
+  outLen = len;
+  if( uncompress(data, &outLen, packed, packedLen) != Z_OK || outLen != len )
+  {
+    fprintf(stderr, "%s - compressed image chunk %ld is damaged\n",
+	    ioName(caller), chunk);
+    free(packed);
+    free(data);
+    imgFail();
+  }
+
+  free(packed);
+  return data;
+}
+
+/*Copies part of one chunk into dest, decompressing the chunk if it isn't
+ *cached. The decompressing happens without the lock held, so threads
+ *missing on different chunks don't wait on each other; if two miss on the
+ *same one, the second copy is just thrown away.*/
+static void copyChunk(imgMap map, long chunk, long from, long len,
+		      unsigned char *dest, int caller)
+{
+  unsigned char *data;
+  zimgCache zimg;
+  zimgSlot slot;
+  int i, victim;
+
+  zimg = map->zimg;
+
+  pthread_mutex_lock(&zimg->lock);
+
+  if(zimg->slotOf[chunk] >= 0)
+  {
+    slot = &zimg->slots[zimg->slotOf[chunk]];
+    slot->lastUse = ++zimg->clock;
+    zimg->hits++;
+    memcpy(dest, slot->data + from, len);
+    pthread_mutex_unlock(&zimg->lock);
+    return;
+  }
+
+  pthread_mutex_unlock(&zimg->lock);
+
+  data = loadChunk(map, chunk, caller);
+
+  pthread_mutex_lock(&zimg->lock);
+
+  /*Someone else got there first*/
+  if(zimg->slotOf[chunk] >= 0)
+  {
+    slot = &zimg->slots[zimg->slotOf[chunk]];
+    slot->lastUse = ++zimg->clock;
+    memcpy(dest, slot->data + from, len);
+    pthread_mutex_unlock(&zimg->lock);
+    free(data);
+    return;
+  }
+
+  /*Replace whichever chunk has gone unused longest*/
+  victim = 0;
+  for(i = 1; i < zimg->numSlots; i++)
+    if(zimg->slots[i].lastUse < zimg->slots[victim].lastUse)
+      victim = i;
+
+  slot = &zimg->slots[victim];
+  if(slot->chunk >= 0)
+    zimg->slotOf[slot->chunk] = -1;
+  free(slot->data);
+
+  slot->chunk = chunk;
+  slot->data = data;
+  slot->lastUse = ++zimg->clock;
+  zimg->slotOf[chunk] = victim;
+  zimg->misses++;
+
+  memcpy(dest, data + from, len);
+  pthread_mutex_unlock(&zimg->lock);
+}
+
+/*imgRead for compressed images: len bytes at offset (already checked
+ *against the image size and counted) are put together in scratch from
+ *every chunk they cover*/
+void *zimgRead(imgMap map, long offset, long len, void *scratch, int caller)
+{
+  long chunk, from, toCopy, done;
+
+  for(done = 0; done < len; done += toCopy)
+  {
+    chunk = (offset + done) / map->zimg->chunkSize;
+    from = (offset + done) % map->zimg->chunkSize;
+    toCopy = map->zimg->chunkSize - from;
+    if(toCopy > len - done)
+      toCopy = len - done;
+
+    copyChunk(map, chunk, from, toCopy, (unsigned char *)scratch + done,
+	      caller);
+  }
+
+  return scratch;
+}
+
+/*Where the compressed bytes for len bytes of image at offset are in the
+ *file, for read-ahead hints*/
+void zimgRange(zimgCache zimg, long offset, long len, long *fileOff,
+	       long *fileLen)
+{
+  long first, last;
+
+  first = offset / zimg->chunkSize;
+  last = (offset + len - 1) / zimg->chunkSize;
+  if(last >= zimg->numChunks)
+    last = zimg->numChunks - 1;
+
+  *fileOff = zimg->index[first];
+  *fileLen = zimg->index[last + 1] - zimg->index[first];
+}
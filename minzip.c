@@ -0,0 +1,174 @@
+/*minzip is a unix program that compresses a minix image into the seekable
+ *format minls, minget and minfsd read directly, without it having to be
+ *decompressed first.
+ *usage:
+
+ minzip [-v] [-c chunk] [-l level] imagefile zimagefile
+
+ *The image is cut into chunk byte pieces, each compressed on its own, with
+ *    an index of where each one went at the end (see zimg_trailer in
+ *    minfs.h). Smaller chunks mean less to decompress for each read,
+ *    bigger ones compress better
+ *level is the zlib compression level
+ *imagefile can be - to compress standard input
+ */
+
+#include "minfs.h"
+#include <zlib.h>
+
+void usage()
+{
+  fprintf(stderr, "usage: minzip [-v] [-c chunk] [-l level]"
+	  " imagefile zimagefile\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "-c  bytes   --- bytes of image per chunk (default: %d)\n",
+	  ZIMG_CHUNK);
+  fprintf(stderr, "-l  level   --- zlib compression level, 0-9 or -1"
+	  " (default: zlib's, 6)\n");
+  fprintf(stderr, "-v  verbose --- print how well it compressed\n");
+  exit(EXIT_FAILURE);
+}
+
+/*Writes len bytes to the compressed image, or bails*/
+static void writeAll(FILE *out, void *data, long len)
+{
+  if( fwrite(data, sizeof(char), len, out) != len )
+  {
+    perror("minzip - fwrite");
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  struct zimg_trailer trailer;
+  unsigned char *raw, *packed;
+  uint64_t *index, offset;
+  long chunkSize, capacity, got;
+  uLongf packedLen;
+  int i, verbose, level;
+  FILE *in, *out;
+
+  verbose = 0;
+  chunkSize = ZIMG_CHUNK;
+  level = Z_DEFAULT_COMPRESSION;
+
+  while((i = getopt(argc, argv, "vc:l:")) != -1)
+    switch(i)
+    {
+      case 'v':
+	      verbose = 1;
+	      break;
+      case 'c':
+	      chunkSize = strtol(optarg, NULL, 10);
+	      /*At least a sector, and small enough for the trailer*/
+	      if(chunkSize < 512 || chunkSize > (1L << 30))
+	        usage();
+	      break;
+      case 'l':
+	      level = strtol(optarg, NULL, 10);
+	      /*-1 is Z_DEFAULT_COMPRESSION*/
+	      if(level < Z_DEFAULT_COMPRESSION || level > 9)
+	        usage();
+	      break;
+      default:
+	      usage();
+	      break;
+    }
+
+  if(optind != argc - 2)
+    usage();
+
+  if(strcmp(argv[optind], "-") == 0)
+    in = stdin;
+  else if( !(in = fopen(argv[optind], "r")) )
+  {
+    perror(argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+
+  if( !(out = fopen(argv[optind + 1], "w")) )
+  {
+    perror(argv[optind + 1]);
+    exit(EXIT_FAILURE);
+  }
+
+  raw = malloc(chunkSize);
+  packed = malloc(compressBound(chunkSize));
+  capacity = 1024;
+  index = malloc(capacity * sizeof(uint64_t));
+
+  memset(&trailer, 0, sizeof(trailer));
+  trailer.magic = ZIMG_MAGIC;
+  trailer.version = ZIMG_VERSION;
+  trailer.chunkSize = chunkSize;
+  offset = 0;
+
+  /*Compress a chunk at a time, noting where each one starts*/
+  while( (got = fread(raw, sizeof(char), chunkSize, in)) > 0 )
+  {
+    if(trailer.numChunks + 1 >= capacity)
+    {
+      capacity *= 2;
+      index = realloc(index, capacity * sizeof(uint64_t));
+    }
+    index[trailer.numChunks++] = offset;
+    trailer.size += got;
+
+    packedLen = compressBound(chunkSize);
+    if( compress2(packed, &packedLen, raw, got, level) != Z_OK )
+    {
+      fprintf(stderr, "minzip - compress failed\n");
+      exit(EXIT_FAILURE);
+    }
+
+    /*Chunks that don't get any smaller are kept as they are, the reader
+     *tells by the length*/
+    if(packedLen >= got)
+    {
+      writeAll(out, raw, got);
+      offset += got;
+    }
+    else
+    {
+      writeAll(out, packed, packedLen);
+      offset += packedLen;
+    }
+
+    if(got < chunkSize)
+      break;
+  }
+
+  if( ferror(in) )
+  {
+    perror("minzip - fread");
+    exit(EXIT_FAILURE);
+  }
+
+  /*Then the end of the last chunk, the index and the trailer*/
+  index[trailer.numChunks] = offset;
+  trailer.indexOff = offset;
+  writeAll(out, index, (trailer.numChunks + 1) * sizeof(uint64_t));
+  writeAll(out, &trailer, sizeof(trailer));
+
+  if( fclose(out) != 0 )
+  {
+    perror(argv[optind + 1]);
+    exit(EXIT_FAILURE);
+  }
+
+  if(verbose)
+    fprintf(stderr, "%lu bytes in %u chunks of %ld, compressed to %lu"
+	    " (%.1f%%)\n", (unsigned long)trailer.size, trailer.numChunks,
+	    chunkSize, (unsigned long)(offset + (trailer.numChunks + 1) *
+				       sizeof(uint64_t) + sizeof(trailer)),
+	    trailer.size ? 100.0 * offset / trailer.size : 0.0);
+
+  if(in != stdin)
+    fclose(in);
+  free(index);
+  free(packed);
+  free(raw);
+
+  return 0;
+}